@@ -0,0 +1,222 @@
+/* Micro-benchmarks of microbash: built from microbash.c itself (see make
+ * bench), so that they time its own functions, and nothing else:
+ * - parse: parse_line + check_line, on lines of growing stages/arguments
+ * - spawn: run_child + waitpid of a single command
+ * - execute: a whole line through execute, with and without the line cache
+ * - pipeline: N-stage pipelines moving a fixed number of bytes
+ * Every benchmark is repeated REPEATS times and the median is reported, so
+ * that runs can be compared with each other: the output has one line per
+ * benchmark, in a fixed order.
+ *
+ * Usage: microbash-bench [-s SCALE] [NAME...]
+ * SCALE multiplies the iterations (default 1), NAMEs select the benchmarks
+ * whose name starts with them.
+ */
+#define main microbash_main
+#include "microbash.c"
+#undef main
+
+#define REPEATS 5
+
+static int scale = 1;
+static char **filters;
+static int n_filters;
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    const double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double median(double *const samples) {
+    qsort(samples, REPEATS, sizeof(double), compare_doubles);
+    return samples[REPEATS / 2];
+}
+
+static int selected(const char *const name) {
+    if (!n_filters)
+        return 1;
+    for (int f = 0; f < n_filters; ++f)
+        if (strncmp(name, filters[f], strlen(filters[f])) == 0)
+            return 1;
+    return 0;
+}
+
+static void report(const char *const name, double ns_per_op, double mb_per_s) {
+    if (mb_per_s > 0)
+        printf("%-40s %14.1f ns/op %10.1f MB/s\n", name, ns_per_op, mb_per_s);
+    else
+        printf("%-40s %14.1f ns/op %10s\n", name, ns_per_op, "-");
+    fflush(stdout);
+}
+
+static char *synthetic_line(int n_stages, int n_args) {
+    /* cmd0 arg1 ... <in | cmd1 arg1 ... | ... >out, in a malloc'ed buffer */
+    size_t size = 64, len = 0;
+    char *line = my_malloc(size);
+    for (int s = 0; s < n_stages; ++s) {
+        for (int a = 0; a <= n_args; ++a) {
+            char word[64];
+            const int n = a ? snprintf(word, sizeof(word), " argument%d", a)
+                            : snprintf(word, sizeof(word), "%scommand%d",
+                                       s ? " | " : "", s);
+            if (len + n + 16 > size)
+                line = my_realloc(line, size *= 2);
+            memcpy(line + len, word, n + 1);
+            len += n;
+        }
+        if (!s)
+            len += sprintf(line + len, " <in");
+    }
+    sprintf(line + len, " >out");
+    return line;
+}
+
+static void bench_parse(int n_stages, int n_args) {
+    char name[64];
+    snprintf(name, sizeof(name), "parse stages=%d args=%d", n_stages, n_args);
+    if (!selected(name))
+        return;
+    char *const text = synthetic_line(n_stages, n_args);
+    const size_t size = strlen(text) + 1;
+    char *const buf = my_malloc(size);
+    const int n_ops = scale * (200000 / (n_stages * (n_args + 1)) + 100);
+    double samples[REPEATS];
+    for (int r = 0; r < REPEATS; ++r) {
+        const double start = now();
+        for (int i = 0; i < n_ops; ++i) {
+            memcpy(buf, text, size); // parse_line tokenizes in place
+            const line_t *const l = parse_line(buf);
+            if (!l || check_line(l) != CHECK_OK)
+                fatal("bench: synthetic line rejected");
+            arena_reset(&line_arena);
+        }
+        samples[r] = (now() - start) * 1e9 / n_ops;
+    }
+    report(name, median(samples), size * 1e3 / median(samples));
+    free(buf);
+    free(text);
+}
+
+static void bench_spawn(void) {
+#ifdef USE_FORK
+    const char *const name = "spawn fork+exec true";
+#else
+    const char *const name = "spawn posix_spawn true";
+#endif
+    if (!selected(name))
+        return;
+    char *args[] = {"true", 0};
+    command_t c;
+    memset(&c, 0, sizeof(c));
+    c.n_args = 1;
+    c.args = args;
+    const int n_ops = scale * 200;
+    double samples[REPEATS];
+    for (int r = 0; r < REPEATS; ++r) {
+        const double start = now();
+        for (int i = 0; i < n_ops; ++i) {
+            const pid_t pid = run_child(&c, NO_REDIR, NO_REDIR, NO_REDIR);
+            if (!pid || waitpid(pid, 0, 0) != pid)
+                fatal("bench: cannot spawn true");
+        }
+        samples[r] = (now() - start) * 1e9 / n_ops;
+    }
+    report(name, median(samples), 0);
+}
+
+static void bench_execute(int line_cache_capacity) {
+    char name[64];
+    snprintf(name, sizeof(name), "execute builtin linecache=%d",
+             line_cache_capacity);
+    if (!selected(name))
+        return;
+    static const char *const text = "true a b c d e f g h i j k l m n o p";
+    const size_t size = strlen(text) + 1;
+    char *const buf = my_malloc(size);
+    const int saved_capacity = line_cache.capacity;
+    line_cache.capacity = line_cache_capacity;
+    const int n_ops = scale * 20000;
+    double samples[REPEATS];
+    for (int r = 0; r < REPEATS; ++r) {
+        const double start = now();
+        for (int i = 0; i < n_ops; ++i) {
+            memcpy(buf, text, size);
+            execute(buf);
+        }
+        samples[r] = (now() - start) * 1e9 / n_ops;
+    }
+    line_cache.capacity = saved_capacity;
+    report(name, median(samples), 0);
+    free(buf);
+}
+
+static void bench_pipeline(int n_stages, const char *const bytes) {
+    /* head -c bytes /dev/zero followed by n_stages "cat -" (not elided by
+     * optimize_pipeline, unlike a bare cat), to /dev/null */
+    char name[64];
+    snprintf(name, sizeof(name), "pipeline stages=%d bytes=%s", n_stages + 1,
+             bytes);
+    if (!selected(name))
+        return;
+    unsigned long long n_bytes;
+    if (parse_size(bytes, &n_bytes))
+        fatal("bench: bad size");
+    char *const text = my_malloc(64 + 8 * n_stages);
+    char *p = text + sprintf(text, "head -c %s /dev/zero", bytes);
+    for (int s = 0; s < n_stages; ++s)
+        p = stpcpy(p, " | cat -");
+    strcpy(p, " >/dev/null");
+    const size_t size = strlen(text) + 1;
+    char *const buf = my_malloc(size);
+    double samples[REPEATS];
+    for (int r = 0; r < REPEATS; ++r) {
+        const double start = now();
+        for (int i = 0; i < scale; ++i) {
+            memcpy(buf, text, size);
+            execute(buf);
+            if (shell.last_status)
+                fatal("bench: pipeline failed");
+        }
+        samples[r] = (now() - start) * 1e9 / scale;
+    }
+    const double ns = median(samples);
+    report(name, ns, n_bytes * 1e3 / ns);
+    free(buf);
+    free(text);
+}
+
+int main(int argc, char *argv[]) {
+    int a = 1;
+    if (a + 1 < argc && strcmp(argv[a], "-s") == 0) {
+        scale = atoi(argv[a + 1]);
+        if (scale < 1) {
+            fprintf(stderr, "Usage: %s [-s SCALE] [NAME...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        a += 2;
+    }
+    filters = argv + a;
+    n_filters = argc - a;
+    // the same state main of microbash sets up
+    shell.pid = getpid();
+    import_environ();
+    init_cwd();
+    printf("microbash bench, scale %d, median of %d runs\n", scale, REPEATS);
+    static const int STAGES[] = {1, 4, 16}, ARGS[] = {1, 8, 64, 512};
+    for (size_t s = 0; s < sizeof(STAGES) / sizeof(*STAGES); ++s)
+        for (size_t g = 0; g < sizeof(ARGS) / sizeof(*ARGS); ++g)
+            bench_parse(STAGES[s], ARGS[g]);
+    bench_spawn();
+    bench_execute(0);
+    bench_execute(line_cache.capacity);
+    static const int PIPE_STAGES[] = {0, 1, 3, 7};
+    for (size_t s = 0; s < sizeof(PIPE_STAGES) / sizeof(*PIPE_STAGES); ++s)
+        bench_pipeline(PIPE_STAGES[s], "64M");
+    return 0;
+}
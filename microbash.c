@@ -14,19 +14,161 @@
  */
 
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #ifndef NO_READLINE
 #include <readline/history.h>
 #include <readline/readline.h>
 #endif
+#include <zlib.h>
+#include <stdalign.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#else
+#define ASAN_POISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#define ASAN_UNPOISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#endif
+
+/* Tracing, compiled in with -DTRACE only: otherwise the TRACE_* macros
+ * expand to nothing. Begin/end events of the phases of each line are
+ * recorded in a ring buffer and written out between lines to
+ * $MICROBASH_TRACE (by default microbash-PID.trace.json), as a Chrome trace
+ * in the JSON array format, which chrome://tracing and Perfetto load. With
+ * <sys/sdt.h>, each event is also the USDT probe microbash:event, for perf
+ * and bpftrace. Only the shell writes the trace: the events recorded by its
+ * forked children, like their exec, are lost.
+ */
+#ifdef TRACE
+#include <stdatomic.h>
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, phase, arg)                                          \
+    STAP_PROBE3(microbash, event, name, phase, arg)
+#else
+#define TRACE_PROBE(name, phase, arg) ((void)0)
+#endif
+
+typedef struct {
+        const char *name; // a string literal
+        char phase;       // 'B'egin or 'E'nd
+        long arg;         // e.g. a pid or an fd
+        uint64_t ns;      // CLOCK_MONOTONIC
+} trace_event_t;
+
+#define TRACE_RING_SIZE 65536 // events
+
+static struct {
+        trace_event_t ring[TRACE_RING_SIZE];
+        atomic_uint_fast64_t head; // events recorded so far
+        uint64_t tail;             // events written so far
+        FILE *out;
+        pid_t pid; // the process writing out
+        int n_written;
+} trace;
+
+void trace_event(const char *const name, char phase, long arg) {
+    // slots are claimed atomically, so recording takes no lock
+    const uint64_t i =
+        atomic_fetch_add_explicit(&trace.head, 1, memory_order_relaxed);
+    trace_event_t *const e = &trace.ring[i % TRACE_RING_SIZE];
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    e->name = name;
+    e->phase = phase;
+    e->arg = arg;
+    e->ns = t.tv_sec * 1000000000ull + t.tv_nsec;
+    TRACE_PROBE(name, phase, arg);
+}
+
+void trace_flush(void) {
+    /* Writes out the events recorded since the last flush; those that have
+     * been overwritten meanwhile are counted in a "dropped" event */
+    if (!trace.out || getpid() != trace.pid)
+        return;
+    const uint64_t head = atomic_load(&trace.head);
+    if (head - trace.tail > TRACE_RING_SIZE) {
+        fprintf(trace.out,
+                "%s{\"name\":\"dropped\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%.3f,"
+                "\"pid\":%d,\"tid\":%d,\"args\":{\"events\":%llu}}\n",
+                trace.n_written++ ? "," : "",
+                trace.ring[head % TRACE_RING_SIZE].ns / 1e3, (int)trace.pid,
+                (int)trace.pid,
+                (unsigned long long)(head - trace.tail - TRACE_RING_SIZE));
+        trace.tail = head - TRACE_RING_SIZE;
+    }
+    for (; trace.tail < head; ++trace.tail) {
+        const trace_event_t *const e =
+            &trace.ring[trace.tail % TRACE_RING_SIZE];
+        fprintf(trace.out,
+                "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"arg\":%ld}}\n",
+                trace.n_written++ ? "," : "", e->name, e->phase, e->ns / 1e3,
+                (int)trace.pid, (int)trace.pid, e->arg);
+    }
+    fflush(trace.out);
+}
+
+void trace_close(void) {
+    if (!trace.out || getpid() != trace.pid)
+        return;
+    trace_flush();
+    fputs("]\n", trace.out);
+    fclose(trace.out);
+    trace.out = 0;
+}
+
+void trace_open(void) {
+    char path[64];
+    const char *pathname = getenv("MICROBASH_TRACE");
+    if (!pathname) {
+        snprintf(path, sizeof(path), "microbash-%d.trace.json", (int)getpid());
+        pathname = path;
+    }
+    if (!(trace.out = fopen(pathname, "we"))) {
+        perror(pathname);
+        return;
+    }
+    fputs("[\n", trace.out);
+    trace.pid = getpid();
+    atexit(trace_close);
+}
+
+#define TRACE_OPEN() trace_open()
+#define TRACE_FLUSH() trace_flush()
+#define TRACE_BEGIN(name, arg) trace_event(name, 'B', arg)
+#define TRACE_END(name, arg) trace_event(name, 'E', arg)
+#else
+#define TRACE_OPEN() ((void)0)
+#define TRACE_FLUSH() ((void)0)
+#define TRACE_BEGIN(name, arg) ((void)0)
+#define TRACE_END(name, arg) ((void)0)
+#endif
 
 void fatal(const char *const msg) {
     fprintf(stderr, "%s\n", msg);
@@ -52,7 +194,7 @@ void *my_realloc(void *ptr, size_t size) {
     return rv;
 }
 
-char *my_strdup(char *ptr) {
+char *my_strdup(const char *ptr) {
     char *rv = strdup(ptr);
     if (!rv)
         fatal_errno("my_strdup");
@@ -63,53 +205,232 @@ char *my_strdup(char *ptr) {
 #define realloc I_really_should_not_be_using_a_bare_realloc
 #define strdup I_really_should_not_be_using_a_bare_strdup
 
+/* Bump allocator for everything that lives as long as a line: a reset frees
+ * it all at once, and keeps the chunks around for the next line, so that in
+ * the steady state parsing causes no malloc at all.
+ * Freed memory is poisoned, so ASan still catches uses after a reset.
+ */
+typedef struct arena_chunk {
+        struct arena_chunk *next;
+        size_t size, used;
+        alignas(max_align_t) char data[];
+} arena_chunk_t;
+
+typedef struct {
+        arena_chunk_t *first, *current;
+} arena_t;
+
+static const size_t ARENA_CHUNK_SIZE = 16 * 1024;
+
+void *arena_alloc(arena_t *const a, size_t size) {
+    size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+    arena_chunk_t *c = a->current;
+    while (c && c->size - c->used < size) {
+        c = c->next;
+        if (c)
+            c->used = 0;
+    }
+    if (!c) {
+        const size_t chunk_size =
+            size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        c = my_malloc(sizeof(*c) + chunk_size);
+        c->size = chunk_size;
+        c->used = 0;
+        ASAN_POISON_MEMORY_REGION(c->data, c->size);
+        if (a->current) {
+            c->next = a->current->next;
+            a->current->next = c;
+        } else {
+            c->next = 0;
+            a->first = c;
+        }
+    }
+    a->current = c;
+    void *const rv = c->data + c->used;
+    c->used += size;
+    ASAN_UNPOISON_MEMORY_REGION(rv, size);
+    return rv;
+}
+
+char *arena_strdup(arena_t *const a, const char *const s) {
+    const size_t size = strlen(s) + 1;
+    return memcpy(arena_alloc(a, size), s, size);
+}
+
+char *arena_printf(arena_t *const a, const char *const format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    const int len = vsnprintf(0, 0, format, ap);
+    va_end(ap);
+    char *const s = arena_alloc(a, len + 1);
+    va_start(ap, format);
+    vsnprintf(s, len + 1, format, ap);
+    va_end(ap);
+    return s;
+}
+
+void arena_reset(arena_t *const a) {
+    for (arena_chunk_t *c = a->first; c; c = c->next) {
+        if (c->used)
+            ASAN_POISON_MEMORY_REGION(c->data, c->used);
+        c->used = 0;
+    }
+    a->current = a->first;
+}
+
+/* A position in an arena, to free everything allocated after it */
+typedef struct {
+        arena_chunk_t *chunk;
+        size_t used;
+} arena_mark_t;
+
+arena_mark_t arena_mark(const arena_t *const a) {
+    arena_mark_t m = {a->current, a->current ? a->current->used : 0};
+    return m;
+}
+
+void arena_release(arena_t *const a, const arena_mark_t m) {
+    if (!m.chunk) {
+        arena_reset(a);
+        return;
+    }
+    for (arena_chunk_t *c = m.chunk; c; c = c->next) {
+        const size_t keep = c == m.chunk ? m.used : 0;
+        if (c->used > keep)
+            ASAN_POISON_MEMORY_REGION(c->data + keep, c->used - keep);
+        c->used = keep;
+    }
+    a->current = m.chunk;
+}
+
+uint64_t hash_string(const char *s) {
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325u;
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 0x100000001b3u;
+    return h;
+}
+
+uint64_t hash_bytes(const char *s, size_t n) {
+    // FNV-1a, like hash_string
+    uint64_t h = 0xcbf29ce484222325u;
+    while (n--)
+        h = (h ^ (unsigned char)*s++) * 0x100000001b3u;
+    return h;
+}
+
+/* Holds the parsed line_t, see execute */
+static arena_t line_arena;
+
 static const int NO_REDIR = -1;
+static const int ERR_TO_OUT = -2; // 2>&1: stderr is a copy of stdout
 
 typedef enum { CHECK_OK = 0, CHECK_FAILED = -1 } check_t;
 
 static const char *const CD = "cd";
+static const char *const TIME = "time";
 
 typedef struct {
         int n_args;
         char **args; // in an execv*-compatible format; i.e., args[n_args]=0
         char *out_pathname; // 0 if no output-redirection is present
+        int out_append;     // >>: appended to instead of truncated
+        char *err_pathname; // 2>, 0 if none
+        int err_append;     // 2>>
+        int err_to_out;     // 2>&1, after the output redirection
         char *in_pathname;  // 0 if no input-redirection is present
+        int in_decompress;  // <z:path: the input is path, gunzip'ed
+        char *here_string;  // <<<word: the input is word and a newline
+        char *here_document; // <<DELIM: the input is the lines up to DELIM
+        int n_assignments;  // NAME=value words before args, see expand_command
+        char **assignments;
+        char *cpus; // @cpu=LIST: the CPUs it may run on, 0 for all of them
+        unsigned long long mem; // @mem=SIZE: its RLIMIT_AS, 0 for none
+        int nice, has_nice;     // @nice=N: its niceness
 } command_t;
 
+static inline int has_limits(const command_t *const c) {
+    return c->cpus || c->mem || c->has_nice;
+}
+
+/* How a pipeline is joined to the previous one of its line */
+typedef enum {
+    OP_SEQ, // the first one, or after ';' or '&': always run
+    OP_AND, // after "&&": run if the previous one succeeded
+    OP_OR   // after "||": run if the previous one failed
+} list_op_t;
+
 typedef struct {
         int n_commands;
         command_t **commands;
-} line_t;
+        int timed;      // the pipeline was prefixed by "time"
+        int background; // the pipeline was terminated by "&"
+        list_op_t op;
+} pipeline_t;
 
-void free_command(command_t *const c) {
-    assert(
-        c == 0 || c->n_args == 0 ||
-        (c->n_args > 0 && c->args[c->n_args] ==
-                              0)); /* sanity-check: if c is not null, then it is
-                                      either empty (in case of parsing error) or
-                                      its args are properly NULL-terminated */
-                                   /*** TO BE DONE START ***/
-    for (int i = 0; i < c->n_args; ++i) {
-        free(c->args[i]);
-    }
-    free(c->out_pathname);
-    free(c->in_pathname);
-    free(c->args);
-    free(c);
+/* A line is a list of pipelines, joined by ';', '&', "&&" and "||"; the ones
+ * joined by "&&" and "||" make up and-or lists, which are run in background
+ * as a whole, if followed by '&'
+ */
+typedef struct {
+        int n_pipelines;
+        pipeline_t **pipelines;
+        int has_here_documents; // whose text follows the line in the input
+} line_t;
 
-    /*** TO BE DONE END ***/
+static inline int has_input(const command_t *const c) {
+    return c->in_pathname || c->here_string || c->here_document;
 }
 
-void free_line(line_t *const l) {
-    assert(l == 0 || l->n_commands >= 0); /* sanity-check */
-                                          /*** TO BE DONE START ***/
-    for (int i = 0; i < l->n_commands; ++i) {
-        free_command(l->commands[i]);
-    }
-    free(l->commands);
-    free(l);
-    /*** TO BE DONE END ***/
-}
+/* A process spawned by execute_line, and what wait_for_children learns about
+ * it */
+typedef struct {
+        pid_t pid; // 0 if no process was spawned (e.g., for builtins)
+        int pidfd; // -1 if there is nothing (more) to wait for
+        char *name;
+        struct timespec start, end; // CLOCK_MONOTONIC
+        struct rusage usage;
+        int status;
+        int torn_down; // sent shell.teardown, see tear_down
+} proc_t;
+
+/* The processes of a line, waited for as a whole. Background jobs stay in
+ * the job table until all their processes have been reaped; unlike lines,
+ * jobs are allocated via malloc, as they can outlive the line arena.
+ */
+typedef struct job {
+        struct job *next;   // in the job table, sorted by id
+        int id;             // 0 if not in the job table (i.e., foreground)
+        char *text;         // the line, as shown by jobs
+        unsigned long line; // see shell.n_lines
+        int n_procs, n_running;
+        proc_t *procs;
+        struct timespec start;
+        int timed;
+        int parallel; // started by the builtin parallel
+} job_t;
+
+static struct {
+        int exit_requested; // set by the builtin exit
+        int exit_status;
+        int pipe_size;      // for F_SETPIPE_SZ, 0 to keep the default
+        off_t prealloc;     // fallocate'd for the output files, 0 for none
+        FILE *stats_log;    // JSON lines written by wait_for_children, if any
+        char *stats_log_pathname;
+        unsigned long n_lines; // executed so far, to tell lines apart in logs
+        job_t *jobs;           // the job table
+        job_t *foreground;     // the job wait_for_children is waiting for
+        int last_status;       // of the last pipeline run in foreground, $?
+        int pipefail;          // a pipeline fails if any of its commands do
+        int wait_last;         // wait only for the last command of pipelines
+        int teardown; // sent to a pipeline when its last command exits, or 0
+        pid_t pid;             // $$, the same in the subshells
+        pid_t last_background; // $!, of the last job started in background
+        FILE *input;           // where the lines come from, 0 for readline
+        struct {
+                int n_running, n_failed; // jobs of the running parallel
+        } parallel;
+} shell;
 
 #ifdef DEBUG
 void print_command(const command_t *const c) {
@@ -122,99 +443,479 @@ void print_command(const command_t *const c) {
         printf("%s ", c->args[a]);
     assert(c->args[c->n_args] == 0);
     printf("] ");
-    printf("in: %s out: %s\n", c->in_pathname, c->out_pathname);
+    printf("in: %s%s out: %s%s err: %s%s\n", c->in_decompress ? "z:" : "",
+           c->in_pathname, c->out_pathname,
+           c->out_append ? " (append)" : "",
+           c->err_to_out ? "&1" : c->err_pathname,
+           c->err_append ? " (append)" : "");
+    if (c->here_string)
+        printf("here-string: %s\n", c->here_string);
+    if (c->here_document)
+        printf("here-document: %s", c->here_document);
+    if (has_limits(c))
+        printf("cpus: %s mem: %llu nice: %s%d\n", c->cpus, c->mem,
+               c->has_nice ? "" : "unset ", c->nice);
 }
 
 void print_line(const line_t *const l) {
+    static const char *const OPS[] = {";", "&&", "||"};
     if (!l) {
         printf("Line == NULL\n");
         return;
     }
-    printf("Line has %d command(s):\n", l->n_commands);
-    for (int a = 0; a < l->n_commands; ++a)
-        print_command(l->commands[a]);
+    printf("Line has %d pipeline(s):\n", l->n_pipelines);
+    for (int p = 0; p < l->n_pipelines; ++p) {
+        const pipeline_t *const pl = l->pipelines[p];
+        printf("%s pipeline has %d command(s)%s%s:\n", OPS[pl->op],
+               pl->n_commands, pl->timed ? ", timed" : "",
+               pl->background ? ", in background" : "");
+        for (int a = 0; a < pl->n_commands; ++a)
+            print_command(pl->commands[a]);
+    }
 }
 #endif
 
-command_t *parse_cmd(char *const cmdstr) {
-    static const char *const BLANKS = " \t";
-    command_t *const result = my_malloc(sizeof(*result));
+static inline int is_blank(char ch) { return ch == ' ' || ch == '\t'; }
+
+static inline int is_separator(char ch) {
+    return ch == '|' || ch == '&' || ch == ';';
+}
+
+typedef enum {
+    SEP_END,       // of the line
+    SEP_PIPE,      // |
+    SEP_AND,       // &&
+    SEP_OR,        // ||
+    SEP_SEMICOLON, // ;
+    SEP_BACKGROUND // &
+} separator_t;
+
+separator_t read_separator(char first, char **const p) {
+    /* first is a separator character (or 0) just consumed, and *p points to
+     * the next character: reads the rest of a two-character separator */
+    switch (first) {
+    case '|':
+        if (**p != '|')
+            return SEP_PIPE;
+        ++*p;
+        return SEP_OR;
+    case '&':
+        if (**p != '&')
+            return SEP_BACKGROUND;
+        ++*p;
+        return SEP_AND;
+    case ';':
+        return SEP_SEMICOLON;
+    }
+    return SEP_END;
+}
+
+/* Appends arg to the (NULL-terminated) arguments of c, whose array has room
+ * for *capacity pointers */
+void push_arg(command_t *const c, int *const capacity, char *const arg) {
+    if (c->n_args + 2 > *capacity) {
+        // double the capacity, as the old array cannot be given back
+        char **const args = arena_alloc(
+            &line_arena, (*capacity = 2 * *capacity + 4) * sizeof(char *));
+        if (c->n_args)
+            memcpy(args, c->args, c->n_args * sizeof(char *));
+        c->args = args;
+    }
+    c->args[c->n_args++] = arg;
+    c->args[c->n_args] = 0;
+}
+
+/* The here-documents of the line being parsed: their text is read by
+ * parse_line, once the whole line has been parsed */
+typedef struct here_document {
+        struct here_document *next;
+        command_t *command; // 0 if the text is to be dropped
+        const char *delimiter;
+        int strip_tabs; // <<-DELIM: leading tabs are removed
+} here_document_t;
+
+static struct {
+        here_document_t *first, **tail;
+} pending_here_documents;
+
+int push_here_document(command_t *const c, const char *const token) {
+    /* Adds the here-document of the token <<DELIM (or <<-DELIM) of c to the
+     * pending ones; returns -1, with nothing added, if DELIM is missing */
+    if (!token[2] || (token[2] == '-' && !token[3]))
+        return -1;
+    here_document_t *const h = arena_alloc(&line_arena, sizeof(*h));
+    h->command = c;
+    h->strip_tabs = token[2] == '-';
+    h->delimiter = token + 2 + h->strip_tabs;
+    h->next = 0;
+    *pending_here_documents.tail = h;
+    pending_here_documents.tail = &h->next;
+    return 0;
+}
+
+void drop_here_documents(const command_t *const c) {
+    /* Like in bash, the last input redirection of c wins, but the text of
+     * the here-documents it replaces still has to be read */
+    for (here_document_t *h = pending_here_documents.first; h; h = h->next)
+        if (h->command == c)
+            h->command = 0;
+}
+
+char *skip_substitution(char *p) {
+    /* p points to the "$(" of a command substitution: returns the end of
+     * it, after the matching ')', or 0 if there is none in the line */
+    int depth = 0;
+    for (++p; *p; ++p)
+        if (*p == '(')
+            ++depth;
+        else if (*p == ')' && !--depth)
+            return p + 1;
+    return 0;
+}
+
+int parse_cpus(const char *s, cpu_set_t *const set) {
+    /* Parses a list of CPUs like 0-3,8 into set */
+    CPU_ZERO(set);
+    do {
+        char *end;
+        const long first = strtol(s, &end, 10);
+        long last = first;
+        if (end == s || first < 0)
+            return -1;
+        if (*end == '-') {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s || last < first)
+                return -1;
+        }
+        if (last >= CPU_SETSIZE || (*end && *end != ','))
+            return -1;
+        for (long cpu = first; cpu <= last; ++cpu)
+            CPU_SET(cpu, set);
+        s = end + 1;
+    } while (s[-1]);
+    return 0;
+}
+
+int parse_size(const char *const s, unsigned long long *const size);
+
+int parse_limit(command_t *const c, char *const word) {
+    /* Parses the prefix word, one of @cpu=LIST, @mem=SIZE and @nice=N, into
+     * c: returns 1 if it is one of them, 0 if not, -1 if its value is wrong */
+    cpu_set_t set;
+    char *end;
+    if (strncmp(word, "@cpu=", 5) == 0) {
+        c->cpus = word + 5;
+        return parse_cpus(c->cpus, &set) ? -1 : 1;
+    }
+    if (strncmp(word, "@mem=", 5) == 0)
+        return parse_size(word + 5, &c->mem) || !c->mem ? -1 : 1;
+    if (strncmp(word, "@nice=", 6) == 0) {
+        errno = 0;
+        const long nice = strtol(word + 6, &end, 10);
+        if (errno || !word[6] || *end || nice < -20 || nice > 19)
+            return -1;
+        c->nice = nice;
+        c->has_nice = 1;
+        return 1;
+    }
+    return 0;
+}
+
+command_t *parse_cmd(char **const cursor, separator_t *const separator) {
+    /* Scans the command starting at *cursor, up to the next separator or the
+     * end of the line, in a single pass: *cursor is left after the
+     * separator, which is stored in *separator.
+     * Tokens are NUL-terminated in place, so args and pathnames point
+     * straight into the line, which must outlive the command. $VAR tokens
+     * are kept as they are: they are expanded right before running the
+     * command (see expand_command), as the previous pipelines of the line
+     * can change the variables; the same goes for $(...), which is kept
+     * whole, blanks and separators included, to be parsed when it is run.
+     * The words before the command may be @cpu=, @mem= and @nice= prefixes.
+     */
+    command_t *const result = arena_alloc(&line_arena, sizeof(*result));
     memset(result, 0, sizeof(*result));
-    char *saveptr, *tmp;
-    tmp = strtok_r(cmdstr, BLANKS, &saveptr);
-    while (tmp) {
-        result->args =
-            my_realloc(result->args, (result->n_args + 2) * sizeof(char *));
-        if (*tmp == '<') {
-            if (result->in_pathname) {
-                fprintf(stderr, "Parsing error: cannot have more than one "
-                                "input redirection\n");
-                goto fail;
+    int capacity = 0;
+    char *p = *cursor;
+    for (;;) {
+        while (is_blank(*p))
+            ++p;
+        if (!*p || is_separator(*p)) {
+            const char first = *p;
+            if (*p)
+                ++p;
+            *separator = read_separator(first, &p);
+            break;
+        }
+        char *tmp = p;
+        // the '&' of 2>&1 is no separator
+        while (*p && !is_blank(*p) &&
+               !(is_separator(*p) && !(*p == '&' && p > tmp && p[-1] == '>')))
+            if (p[0] == '$' && p[1] == '(') {
+                if (!(p = skip_substitution(p))) {
+                    fprintf(stderr, "Parsing error: missing ')' after $(\n");
+                    return 0;
+                }
+            } else
+                ++p;
+        const char end = *p;
+        *p = 0;
+        if (end) // the token was terminated over a blank or a separator
+            ++p;
+        // has_input does not see the pending here-documents, which the other
+        // input redirections replace (see drop_here_documents)
+        if (*tmp == '<' && !(tmp[1] == '<' && tmp[2] != '<') &&
+            has_input(result)) {
+            fprintf(stderr, "Parsing error: cannot have more than one "
+                            "input redirection\n");
+            return 0;
+        }
+        if (tmp[0] == '<' && tmp[1] == '<' && tmp[2] == '<') {
+            drop_here_documents(result);
+            result->here_string = tmp + 3; // may be empty, like in bash
+        } else if (tmp[0] == '<' && tmp[1] == '<') {
+            drop_here_documents(result);
+            result->in_pathname = result->here_string = 0;
+            result->in_decompress = 0;
+            if (push_here_document(result, tmp)) {
+                fprintf(stderr,
+                        "Parsing error: no delimiter specified for "
+                        "here-document\n");
+                return 0;
             }
+        } else if (*tmp == '<') {
+            drop_here_documents(result);
             if (!tmp[1]) {
                 fprintf(
                     stderr,
                     "Parsing error: no path specified for input redirection\n");
-                goto fail;
+                return 0;
+            }
+            result->in_decompress = strncmp(tmp + 1, "z:", 2) == 0;
+            result->in_pathname = tmp + 1 + 2 * result->in_decompress;
+            if (!*result->in_pathname) {
+                fprintf(stderr, "Parsing error: no path specified for "
+                                "decompressed input redirection\n");
+                return 0;
             }
-            result->in_pathname = my_strdup(tmp + 1);
         } else if (*tmp == '>') {
             if (result->out_pathname) {
                 fprintf(stderr, "Parsing error: cannot have more than one "
                                 "output redirection\n");
-                goto fail;
+                return 0;
             }
-            if (!tmp[1]) {
+            result->out_append = tmp[1] == '>';
+            if (!tmp[1 + result->out_append]) {
                 fprintf(stderr, "Parsing error: no path specified for output "
                                 "redirection\n");
-                goto fail;
+                return 0;
+            }
+            result->out_pathname = tmp + 1 + result->out_append;
+        } else if (tmp[0] == '2' && tmp[1] == '>') {
+            if (result->err_pathname || result->err_to_out) {
+                fprintf(stderr, "Parsing error: cannot have more than one "
+                                "error redirection\n");
+                return 0;
+            }
+            result->err_append = tmp[2] == '>';
+            if (strcmp(tmp + 2, "&1") == 0) {
+                result->err_to_out = 1;
+            } else if (!tmp[2 + result->err_append]) {
+                fprintf(stderr, "Parsing error: no path specified for error "
+                                "redirection\n");
+                return 0;
+            } else {
+                result->err_pathname = tmp + 2 + result->err_append;
             }
-            result->out_pathname = my_strdup(tmp + 1);
         } else {
-            if (*tmp == '$') {
-                /* Make tmp point to the value of the corresponding environment
-                 * variable, if any, or the empty string otherwise */
-                /*** TO BE DONE START ***/
-                tmp = getenv(tmp + 1);
-                tmp = (tmp == NULL) ? "" : tmp;
-                /*** TO BE DONE END ***/
+            const int limit = result->n_args ? 0 : parse_limit(result, tmp);
+            if (limit < 0) {
+                fprintf(stderr, "Parsing error: invalid prefix %s\n", tmp);
+                return 0;
             }
-            result->args[result->n_args++] = my_strdup(tmp);
-            result->args[result->n_args] = 0;
+            if (!limit)
+                push_arg(result, &capacity, tmp);
+        }
+        if (!end || is_separator(end)) {
+            *separator = read_separator(end, &p);
+            break;
         }
-        tmp = strtok_r(0, BLANKS, &saveptr);
     }
+    *cursor = p;
     if (result->n_args)
         return result;
     fprintf(stderr, "Parsing error: empty command\n");
-fail:
-    free_command(result);
     return 0;
 }
 
-line_t *parse_line(char *const line) {
-    static const char *const PIPE = "|";
-    char *cmd, *saveptr;
-    cmd = strtok_r(line, PIPE, &saveptr);
-    if (!cmd)
-        return 0;
-    line_t *result = my_malloc(sizeof(*result));
+pipeline_t *parse_pipeline(char **const cursor, separator_t *const separator) {
+    /* Scans the commands starting at *cursor, up to the first separator that
+     * is not a '|', like parse_cmd */
+    pipeline_t *result = arena_alloc(&line_arena, sizeof(*result));
     memset(result, 0, sizeof(*result));
-    while (cmd) {
-        command_t *const c = parse_cmd(cmd);
-        if (!c) {
-            free_line(result);
+    int capacity = 0;
+    do {
+        command_t *const c = parse_cmd(cursor, separator);
+        if (!c)
             return 0;
+        if (result->n_commands == capacity) {
+            command_t **const commands = arena_alloc(
+                &line_arena, (capacity = 2 * capacity + 4) * sizeof(c));
+            if (result->n_commands)
+                memcpy(commands, result->commands,
+                       result->n_commands * sizeof(c));
+            result->commands = commands;
         }
-        result->commands = my_realloc(
-            result->commands, (result->n_commands + 1) * sizeof(command_t *));
         result->commands[result->n_commands++] = c;
-        cmd = strtok_r(0, PIPE, &saveptr);
+    } while (*separator == SEP_PIPE);
+    command_t *const first = result->commands[0];
+    if (strcmp(first->args[0], TIME) == 0) {
+        if (first->n_args == 1) {
+            fprintf(stderr, "Parsing error: empty command after %s\n", TIME);
+            return 0;
+        }
+        result->timed = 1;
+        ++first->args;
+        --first->n_args;
+    }
+    return result;
+}
+
+line_t *parse_list(char *const line) {
+    char *p = line;
+    while (is_blank(*p))
+        ++p;
+    if (!*p)
+        return 0;
+    line_t *result = arena_alloc(&line_arena, sizeof(*result));
+    memset(result, 0, sizeof(*result));
+    int capacity = 0;
+    list_op_t op = OP_SEQ;
+    for (;;) {
+        separator_t separator;
+        pipeline_t *const pl = parse_pipeline(&p, &separator);
+        if (!pl)
+            return 0;
+        pl->op = op;
+        if (result->n_pipelines == capacity) {
+            pipeline_t **const pipelines = arena_alloc(
+                &line_arena, (capacity = 2 * capacity + 4) * sizeof(pl));
+            if (result->n_pipelines)
+                memcpy(pipelines, result->pipelines,
+                       result->n_pipelines * sizeof(pl));
+            result->pipelines = pipelines;
+        }
+        result->pipelines[result->n_pipelines++] = pl;
+        switch (separator) {
+        case SEP_AND:
+            op = OP_AND;
+            break;
+        case SEP_OR:
+            op = OP_OR;
+            break;
+        case SEP_BACKGROUND:
+            pl->background = 1;
+            /* fall through */
+        case SEP_SEMICOLON:
+            op = OP_SEQ;
+            while (is_blank(*p))
+                ++p;
+            if (!*p) // a final ';' or '&' ends the line
+                return result;
+            break;
+        default:
+            return result;
+        }
+    }
+}
+
+char *read_input_line(const char *const prompt);
+
+int read_here_documents(void) {
+    /* Reads the text of the pending here-documents, in order, from the input
+     * of the shell; returns -1 if the input ended first */
+    for (here_document_t *h = pending_here_documents.first; h; h = h->next) {
+        size_t len = 0, size = 256;
+        char *text = my_malloc(size), *line;
+        while ((line = read_input_line("> "))) {
+            const char *l = line;
+            if (h->strip_tabs)
+                while (*l == '\t')
+                    ++l;
+            if (strcmp(l, h->delimiter) == 0)
+                break;
+            const size_t n = strlen(l);
+            if (len + n + 2 > size)
+                text = my_realloc(text, size = 2 * (len + n + 2));
+            memcpy(text + len, l, n);
+            text[len += n] = '\n';
+            ++len;
+            free(line);
+        }
+        text[len] = 0;
+        if (h->command)
+            h->command->here_document = arena_strdup(&line_arena, text);
+        free(text);
+        if (!line) {
+            fprintf(stderr,
+                    "Parsing error: here-document delimited by end of input "
+                    "(wanted '%s')\n",
+                    h->delimiter);
+            return -1;
+        }
+        free(line);
+    }
+    return 0;
+}
+
+void scan_here_documents(char *p, const char *const end) {
+    /* After a parsing error: registers, to be dropped, the here-documents of
+     * the whole line from p to end, where parse_cmd may have put NULs between
+     * the tokens, so that their text is not run as commands */
+    pending_here_documents.first = 0;
+    pending_here_documents.tail = &pending_here_documents.first;
+    while (p < end) {
+        if (!*p || is_blank(*p) || is_separator(*p)) {
+            ++p;
+            continue;
+        }
+        char *const token = p;
+        while (p < end && *p && !is_blank(*p) && !is_separator(*p))
+            if (p[0] == '$' && p[1] == '(') {
+                if (!(p = skip_substitution(p)))
+                    return; // the rest is inside the $(
+            } else
+                ++p;
+        if (p < end)
+            *p++ = 0;
+        if (token[0] == '<' && token[1] == '<' && token[2] != '<')
+            push_here_document(0, token);
+    }
+}
+
+line_t *parse_line(char *const line) {
+    /* Everything is allocated in line_arena, so nothing has to be freed in
+     * case of errors either: execute resets the arena after each line
+     */
+    pending_here_documents.first = 0;
+    pending_here_documents.tail = &pending_here_documents.first;
+    const size_t len = strlen(line);
+    line_t *const result = parse_list(line);
+    // even after a parsing error, the text of the here-documents of the
+    // line must not be run as commands
+    if (!result)
+        scan_here_documents(line, line + len);
+    if (pending_here_documents.first) {
+        if (read_here_documents())
+            return 0;
+        if (result)
+            result->has_here_documents = 1;
     }
     return result;
 }
 
-check_t check_redirections(const line_t *const l) {
+check_t check_redirections(const pipeline_t *const l) {
     assert(l);
     /* This function must check that:
      * - Only the first command of a line can have input-redirection
@@ -224,7 +925,7 @@ check_t check_redirections(const line_t *const l) {
      */
     /*** TO BE DONE START ***/
     for (int i = 0; i < l->n_commands; ++i) {
-        if (l->commands[i]->in_pathname && i != 0) {
+        if (has_input(l->commands[i]) && i != 0) {
             fprintf(stderr,
                     "Parsing error: cannot have input-redirection except "
                     "in the first command\n");
@@ -240,7 +941,19 @@ check_t check_redirections(const line_t *const l) {
     return CHECK_OK;
 }
 
-check_t check_cd(const line_t *const l) {
+size_t assignment_name_len(const char *const s);
+
+int command_name_index(const command_t *const c) {
+    /* Returns the index in args of the name of c, after its NAME=value words,
+     * which stay in args until expand_command moves them to assignments */
+    int a = 0;
+    if (!c->assignments)
+        while (a < c->n_args && assignment_name_len(c->args[a]))
+            ++a;
+    return a;
+}
+
+check_t check_cd(const pipeline_t *const l) {
     assert(l);
     /* This function must check that if command "cd" is present in l, then such
      * a command 1) must be the only command of the line 2) cannot have I/O
@@ -252,14 +965,18 @@ check_t check_cd(const line_t *const l) {
 
     // if there is a cd that is not the first command: fail
     for (int i = 1; i < l->n_commands; ++i) {
-        if (strcmp(l->commands[i]->args[0], CD) == 0) {
+        const command_t *const c = l->commands[i];
+        const int a = command_name_index(c);
+        if (a < c->n_args && strcmp(c->args[a], CD) == 0) {
             fprintf(stderr, "Parsing error: cannot have CD in pipe\n");
             return CHECK_FAILED;
         }
     }
 
     // if the cd is not the first command ok
-    if (strcmp(l->commands[0]->args[0], CD)) {
+    const command_t *const c = l->commands[0];
+    const int a = command_name_index(c);
+    if (a == c->n_args || strcmp(c->args[a], CD)) {
         return CHECK_OK;
     }
 
@@ -269,17 +986,17 @@ check_t check_cd(const line_t *const l) {
                 "Parsing error: cannot have more that one command with CD\n");
         return CHECK_FAILED;
     }
-    if (l->commands[0]->in_pathname) {
+    if (has_input(c)) {
         fprintf(stderr,
                 "Parsing error: cannot have input-redirection with CD\n");
         return CHECK_FAILED;
     }
-    if (l->commands[0]->out_pathname) {
+    if (c->out_pathname) {
         fprintf(stderr,
                 "Parsing error: cannot have output-redirection with CD\n");
         return CHECK_FAILED;
     }
-    if (l->commands[0]->n_args != 2) {
+    if (c->n_args - a != 2) {
         fprintf(stderr,
                 "Parsing error: cannot have more than one argument with CD\n");
         return CHECK_FAILED;
@@ -288,213 +1005,3625 @@ check_t check_cd(const line_t *const l) {
     return CHECK_OK;
 }
 
-void wait_for_children(void) {
-    /* This function must wait for the termination of all child processes.
-     * If a child exits with an exit-status!=0, then you should print a
-     * proper message containing its PID and exit-status. Similarly, if a
-     * child is killed by a signal, then you should print a message
-     * specifying its PID, signal number and signal name.
-     */
-    /*** TO BE DONE START ***/
-    int status;
-    pid_t pid;
+double elapsed(const struct timespec *const from,
+               const struct timespec *const to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
 
-    // -1 wait all child
-    while ((pid = waitpid(-1, &status, 0)) > 0) {
-        // True if the process terminated normally by a call to _exit(2) or
-        // exit(3).
-        if (WIFEXITED(status)) {
-            int exit_status = WEXITSTATUS(status);
-            if (exit_status != 0) {
-                printf("Child with PID %d exited with status %d.\n", pid,
-                       exit_status);
-            }
-        }
-        // True if the process terminated due to receipt of a signal.
-        else if (WIFSIGNALED(status)) {
-            int signal_num = WTERMSIG(status);
-            printf("Child with PID %d was killed by signal %d (%s).\n", pid,
-                   signal_num, strsignal(signal_num));
-        }
+double timeval_seconds(const struct timeval *const tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+void json_string(FILE *const f, const char *s) {
+    putc('"', f);
+    for (; *s; ++s) {
+        const unsigned char ch = *s;
+        if (ch == '"' || ch == '\\')
+            fprintf(f, "\\%c", ch);
+        else if (ch < 0x20)
+            fprintf(f, "\\u%04x", ch);
+        else
+            putc(ch, f);
     }
-    /*** TO BE DONE END ***/
+    putc('"', f);
 }
 
-void redirect(int from_fd, int to_fd) {
-    /* If from_fd!=NO_REDIR, then the corresponding open file should be
-     * "moved" to to_fd. That is, use dup/dup2/close to make to_fd
-     * equivalent to the original from_fd, and then close from_fd
-     */
-    /*** TO BE DONE START ***/
-    if (from_fd != NO_REDIR && from_fd != to_fd) {
-        if (dup2(from_fd, to_fd) == -1) {
-            fatal_errno("dup2 failed");
+void log_proc(const job_t *const j, const proc_t *const p, int stage) {
+    FILE *const f = shell.stats_log;
+    fprintf(f, "{\"line\":%lu,\"stage\":%d,\"pid\":%d,\"cmd\":", j->line,
+            stage, p->pid);
+    json_string(f, p->name);
+    fprintf(f,
+            ",\"wall_s\":%.6f,\"user_s\":%.6f,\"sys_s\":%.6f,"
+            "\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld,",
+            elapsed(&p->start, &p->end), timeval_seconds(&p->usage.ru_utime),
+            timeval_seconds(&p->usage.ru_stime), p->usage.ru_maxrss,
+            p->usage.ru_nvcsw, p->usage.ru_nivcsw);
+    if (WIFSIGNALED(p->status))
+        fprintf(f, "\"signal\":%d}\n", WTERMSIG(p->status));
+    else
+        fprintf(f, "\"exit\":%d}\n", WEXITSTATUS(p->status));
+}
+
+void print_time(const char *const label, double seconds) {
+    const int minutes = seconds / 60;
+    fprintf(stderr, "%s\t%dm%.3fs\n", label, minutes, seconds - 60 * minutes);
+}
+
+void free_job(job_t *const j) {
+    for (int p = 0; p < j->n_procs; ++p) {
+        if (j->procs[p].pidfd >= 0)
+            close(j->procs[p].pidfd);
+        free(j->procs[p].name);
+    }
+    free(j->procs);
+    free(j->text);
+    free(j);
+}
+
+void add_job(job_t *const j) {
+    /* Gives j the smallest free id, and puts it into the job table */
+    job_t **link = &shell.jobs;
+    j->id = 1;
+    while (*link && (*link)->id == j->id) {
+        link = &(*link)->next;
+        ++j->id;
+    }
+    j->next = *link;
+    *link = j;
+}
+
+void remove_job(job_t *const j) {
+    for (job_t **link = &shell.jobs; *link; link = &(*link)->next)
+        if (*link == j) {
+            *link = j->next;
+            j->id = 0;
+            return;
         }
+}
 
-        if (close(from_fd) == -1) {
-            fatal_errno("close failed");
+void forget_jobs(void) {
+    /* In a child forked by the shell: the jobs of the shell are not its
+     * children, and its exit-status comes after all of its own commands */
+    shell.jobs = shell.foreground = 0;
+    shell.wait_last = 0;
+}
+
+int proc_status(const proc_t *const p) {
+    return WIFSIGNALED(p->status) ? 128 + WTERMSIG(p->status)
+                                  : WEXITSTATUS(p->status);
+}
+
+int killed_by_teardown(const proc_t *const p) {
+    return p->torn_down && WIFSIGNALED(p->status) &&
+           WTERMSIG(p->status) == shell.teardown;
+}
+
+int job_status(const job_t *const j) {
+    /* The exit-status of a job is the one of its last command or, with
+     * pipefail, the one of the last command that failed, not counting those
+     * that tear_down killed */
+    if (shell.pipefail)
+        for (int a = j->n_procs - 1; a >= 0; --a)
+            if (proc_status(&j->procs[a]) && !killed_by_teardown(&j->procs[a]))
+                return proc_status(&j->procs[a]);
+    return proc_status(&j->procs[j->n_procs - 1]);
+}
+
+void finish_job(job_t *const j) {
+    /* Reports the resource usage of the job j, whose processes have all been
+     * reaped; if j is in the job table, it is also removed and freed */
+    if (j->timed || shell.stats_log) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double user = 0, sys = 0;
+        for (int p = 0; p < j->n_procs; ++p) {
+            if (!j->procs[p].pid)
+                continue;
+            user += timeval_seconds(&j->procs[p].usage.ru_utime);
+            sys += timeval_seconds(&j->procs[p].usage.ru_stime);
+            if (shell.stats_log)
+                log_proc(j, &j->procs[p], p);
+        }
+        if (shell.stats_log) {
+            fprintf(shell.stats_log,
+                    "{\"line\":%lu,\"commands\":%d,\"wall_s\":%.6f,"
+                    "\"user_s\":%.6f,\"sys_s\":%.6f}\n",
+                    j->line, j->n_procs, elapsed(&j->start, &end), user, sys);
+            fflush(shell.stats_log);
+        }
+        if (j->timed) {
+            fflush(stdout);
+            print_time("real", elapsed(&j->start, &end));
+            print_time("user", user);
+            print_time("sys", sys);
         }
     }
-    /*** TO BE DONE END ***/
+    if (j->id) {
+        const int status = job_status(j);
+        if (status)
+            printf("[%d] Exit %d\t%s\n", j->id, status, j->text);
+        else
+            printf("[%d] Done\t%s\n", j->id, j->text);
+        if (j->parallel) {
+            --shell.parallel.n_running;
+            shell.parallel.n_failed += status != 0;
+        }
+        remove_job(j);
+        free_job(j);
+    }
 }
 
-void run_child(const command_t *const c, int c_stdin, int c_stdout) {
-    /* This function must:
-     * 1) create a child process, then, in the child
-     * 2) redirect c_stdin to STDIN_FILENO (=0)
-     * 3) redirect c_stdout to STDOUT_FILENO (=1)
-     * 4) execute the command specified in c->args[0] with the corresponding
-     * arguments c->args (printing error messages in case of failure,
-     * obviously)
+void report_status(pid_t pid, int status) {
+    /* If a child exits with an exit-status!=0, then you should print a
+     * proper message containing its PID and exit-status. Similarly, if a
+     * child is killed by a signal, then you should print a message
+     * specifying its PID, signal number and signal name.
      */
     /*** TO BE DONE START ***/
-    pid_t pid = fork();
-
-    if (pid < 0) {
-        fatal_errno("fork failed on run_child");
+    // True if the process terminated normally by a call to _exit(2) or
+    // exit(3).
+    if (WIFEXITED(status)) {
+        int exit_status = WEXITSTATUS(status);
+        if (exit_status != 0) {
+            printf("Child with PID %d exited with status %d.\n", pid,
+                   exit_status);
+        }
     }
-
-    if (pid == 0) {
-        redirect(c_stdin, STDIN_FILENO);
-        redirect(c_stdout, STDOUT_FILENO);
-        execvp(c->args[0], c->args);
-        // if exec return, an error occurred
-        fatal_errno(c->args[0]);
+    // True if the process terminated due to receipt of a signal.
+    else if (WIFSIGNALED(status)) {
+        int signal_num = WTERMSIG(status);
+        printf("Child with PID %d was killed by signal %d (%s).\n", pid,
+               signal_num, strsignal(signal_num));
     }
     /*** TO BE DONE END ***/
 }
 
-void change_current_directory(char *newdir) {
-    /* Change the current working directory to newdir
-     * (printing an appropriate error message if the syscall fails)
+void tear_down(job_t *const j) {
+    /* The last process of j has terminated: sends shell.teardown to the
+     * others still running, which could otherwise keep computing until they
+     * next write to the pipe nobody reads anymore. Unlike a signal to a
+     * process group, a pidfd can only reach the process it was opened for.
      */
-    /*** TO BE DONE START ***/
-    if (chdir(newdir) == -1) {
-        perror("error in change directory");
+    for (int p = 0; p < j->n_procs - 1; ++p) {
+        proc_t *const q = &j->procs[p];
+        if (q->pidfd < 0)
+            continue;
+        if (syscall(SYS_pidfd_send_signal, q->pidfd, shell.teardown, 0, 0) ==
+            0)
+            q->torn_down = 1;
+        else if (errno != ESRCH) // ESRCH: it has just exited
+            fatal_errno("pidfd_send_signal");
     }
-    /*** TO BE DONE END ***/
 }
 
-void close_if_needed(int fd) {
-    if (fd == NO_REDIR)
-        return; // nothing to do
-    if (close(fd))
-        perror("close in close_if_needed");
+int expected_death(const job_t *const j, const proc_t *const p) {
+    /* Killed by SIGPIPE, as the next commands of the pipeline have exited
+     * before reading all its output, or by tear_down: not worth a report */
+    const int last = p == &j->procs[j->n_procs - 1];
+    return (!last && WIFSIGNALED(p->status) &&
+            WTERMSIG(p->status) == SIGPIPE) ||
+           killed_by_teardown(p);
 }
 
-void execute_line(const line_t *const l) {
-    if (strcmp(CD, l->commands[0]->args[0]) == 0) {
-        assert(l->n_commands == 1 && l->commands[0]->n_args == 2);
-        change_current_directory(l->commands[0]->args[1]);
+void reap(job_t *const j, proc_t *const p) {
+    /* p, a process of j, has terminated: collects its status and usage */
+    TRACE_BEGIN("reap", p->pid);
+    if (wait4(p->pid, &p->status, 0, &p->usage) < 0)
+        fatal_errno("wait4");
+    clock_gettime(CLOCK_MONOTONIC, &p->end);
+    close(p->pidfd);
+    p->pidfd = -1;
+    if (!expected_death(j, p))
+        report_status(p->pid, p->status);
+    if (shell.teardown && p == &j->procs[j->n_procs - 1])
+        tear_down(j);
+    TRACE_END("reap", p->status);
+    if (!--j->n_running && j->id)
+        finish_job(j);
+}
+
+void reap_children(int timeout) {
+    /* Waits up to timeout milliseconds (-1 means forever) for processes of
+     * the foreground job and of the job table to terminate, polling their
+     * pidfds, and reaps them. Unlike waitpid(-1, ...), this never reaps
+     * (and steals the status of) a process of some other job.
+     */
+    static struct pollfd *pollfds;
+    static struct {
+            job_t *job;
+            proc_t *proc;
+    } *polled;
+    static int capacity;
+    int n = 0;
+    job_t *const lists[] = {shell.foreground, shell.jobs};
+    for (int l = 0; l < 2; ++l)
+        for (job_t *j = lists[l]; j; j = l ? j->next : 0)
+            for (int p = 0; p < j->n_procs; ++p) {
+                if (j->procs[p].pidfd < 0)
+                    continue;
+                if (n == capacity) {
+                    capacity = 2 * capacity + 8;
+                    pollfds =
+                        my_realloc(pollfds, capacity * sizeof(*pollfds));
+                    polled = my_realloc(polled, capacity * sizeof(*polled));
+                }
+                pollfds[n].fd = j->procs[p].pidfd;
+                pollfds[n].events = POLLIN;
+                polled[n].job = j;
+                polled[n].proc = &j->procs[p];
+                ++n;
+            }
+    if (!n)
         return;
-    }
-    int next_stdin = NO_REDIR;
+    const int rv = poll(pollfds, n, timeout);
+    if (rv < 0 && errno != EINTR)
+        fatal_errno("poll");
+    for (int i = 0; i < n && rv > 0; ++i)
+        if (pollfds[i].revents)
+            reap(polled[i].job, polled[i].proc);
+}
+
+void wait_for_children(job_t *const j) {
+    /* This function must wait for the termination of all child processes
+     * of j, which must not be in the job table; meanwhile, the background
+     * jobs that terminate are reaped (and reported) too
+     */
+    assert(!j->id);
+    TRACE_BEGIN("wait_for_children", j->n_running);
+    shell.foreground = j;
+    while (j->n_running)
+        reap_children(-1);
+    shell.foreground = 0;
+    TRACE_END("wait_for_children", 0);
+}
+
+int wait_for_last(job_t *const j) {
+    /* Like wait_for_children, but returns as soon as the last process of j
+     * has terminated: true if other processes of j are still running */
+    assert(!j->id);
+    const proc_t *const last = &j->procs[j->n_procs - 1];
+    shell.foreground = j;
+    while (last->pidfd >= 0)
+        reap_children(-1);
+    shell.foreground = 0;
+    return j->n_running > 0;
+}
+
+/* Shell variables: a hash table in front of the environment, which is only
+ * read once, at startup. Each variable is kept as "NAME=value", so that the
+ * envp of the children is just an array of pointers to the exported ones,
+ * rebuilt only after one of them changes (see exported_envp).
+ */
+typedef struct var {
+        struct var *next;
+        char *text; // "NAME=value", or "NAME" if exported before being set
+        size_t name_len;
+        int exported;
+} var_t;
+
+static struct {
+        var_t **buckets;
+        int n_buckets, n_entries, n_exported;
+        char **envp; // of the children, 0 when out of date
+} variables;
+
+static inline int is_name_char(char ch) {
+    return ch == '_' || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+           (ch >= '0' && ch <= '9');
+}
+
+size_t identifier_len(const char *const s) {
+    /* Returns the length of the identifier s starts with, 0 if none */
+    if (*s >= '0' && *s <= '9')
+        return 0;
+    size_t len = 0;
+    while (is_name_char(s[len]))
+        ++len;
+    return len;
+}
+
+int is_identifier(const char *const s) {
+    const size_t len = identifier_len(s);
+    return len && !s[len];
+}
+
+size_t assignment_name_len(const char *const s) {
+    /* Returns the length of NAME if s is NAME=value, 0 otherwise */
+    const size_t len = identifier_len(s);
+    return s[len] == '=' ? len : 0;
+}
+
+var_t **var_find(const char *const name, size_t len) {
+    /* Returns the link pointing to the variable called name (len characters
+     * long), or to the 0 ending its bucket */
+    if (!variables.n_buckets) {
+        variables.n_buckets = 64;
+        variables.buckets = my_malloc(variables.n_buckets * sizeof(var_t *));
+        memset(variables.buckets, 0, variables.n_buckets * sizeof(var_t *));
+    }
+    var_t **link = &variables.buckets[hash_bytes(name, len) &
+                                      (variables.n_buckets - 1)];
+    while (*link && !((*link)->name_len == len &&
+                      memcmp((*link)->text, name, len) == 0))
+        link = &(*link)->next;
+    return link;
+}
+
+void var_grow(void) {
+    const int n_buckets = 2 * variables.n_buckets;
+    var_t **const buckets = my_malloc(n_buckets * sizeof(*buckets));
+    memset(buckets, 0, n_buckets * sizeof(*buckets));
+    for (int b = 0; b < variables.n_buckets; ++b) {
+        var_t *v = variables.buckets[b];
+        while (v) {
+            var_t *const next = v->next;
+            var_t **const bucket =
+                &buckets[hash_bytes(v->text, v->name_len) & (n_buckets - 1)];
+            v->next = *bucket;
+            *bucket = v;
+            v = next;
+        }
+    }
+    free(variables.buckets);
+    variables.buckets = buckets;
+    variables.n_buckets = n_buckets;
+}
+
+void envp_changed(void) {
+    free(variables.envp);
+    variables.envp = 0;
+}
+
+const char *var_get(const char *const name) {
+    /* Returns the value of the variable name, 0 if unset */
+    const var_t *const v = *var_find(name, strlen(name));
+    return v && v->text[v->name_len] ? v->text + v->name_len + 1 : 0;
+}
+
+void var_set(const char *const name, size_t len, const char *const value,
+             int export) {
+    /* Sets the variable called name (len characters long) to value, or
+     * leaves its value alone if value is 0; export > 0 exports it too */
+    var_t **const link = var_find(name, len);
+    var_t *v = *link;
+    if (!v) {
+        if (!value && export <= 0)
+            return;
+        v = my_malloc(sizeof(*v));
+        memset(v, 0, sizeof(*v));
+        v->name_len = len;
+        if (!value) { // export NAME: exported once it gets a value
+            v->text = my_malloc(len + 1);
+            memcpy(v->text, name, len);
+            v->text[len] = 0;
+        }
+        *link = v;
+        ++variables.n_entries;
+    }
+    if (value) {
+        const size_t value_len = strlen(value);
+        char *const text = my_malloc(len + value_len + 2);
+        memcpy(text, name, len);
+        text[len] = '=';
+        memcpy(text + len + 1, value, value_len + 1);
+        free(v->text);
+        v->text = text;
+    }
+    if (export > 0 && !v->exported) {
+        v->exported = 1;
+        ++variables.n_exported;
+    }
+    // the old text is gone: the envp pointing to it must be rebuilt
+    if (v->exported)
+        envp_changed();
+    if (variables.n_entries > 2 * variables.n_buckets)
+        var_grow();
+}
+
+void var_unset(const char *const name) {
+    var_t **const link = var_find(name, strlen(name));
+    var_t *const v = *link;
+    if (!v)
+        return;
+    *link = v->next;
+    --variables.n_entries;
+    if (v->exported) {
+        --variables.n_exported;
+        envp_changed();
+    }
+    free(v->text);
+    free(v);
+}
+
+void import_environ(void) {
+    for (char **e = environ; *e; ++e) {
+        const char *const eq = strchr(*e, '=');
+        if (eq)
+            var_set(*e, eq - *e, eq + 1, 1);
+    }
+}
+
+char **exported_envp(void) {
+    /* Returns the envp of the children, rebuilt only if needed */
+    if (variables.envp)
+        return variables.envp;
+    char **const envp =
+        my_malloc((variables.n_exported + 1) * sizeof(char *));
+    int n = 0;
+    for (int b = 0; b < variables.n_buckets; ++b)
+        for (const var_t *v = variables.buckets[b]; v; v = v->next)
+            if (v->exported && v->text[v->name_len])
+                envp[n++] = v->text;
+    envp[n] = 0;
+    return variables.envp = envp;
+}
+
+char **command_envp(const command_t *const c) {
+    /* Returns the envp of c: the exported variables, overridden by the
+     * NAME=value words preceding c, which affect c only */
+    char **const envp = exported_envp();
+    if (!c->n_assignments)
+        return envp;
+    char **const result = arena_alloc(
+        &line_arena,
+        (variables.n_exported + c->n_assignments + 1) * sizeof(char *));
+    int n = 0;
+    for (char **e = envp; *e; ++e) {
+        const size_t len = strcspn(*e, "=");
+        int a = 0;
+        while (a < c->n_assignments &&
+               !(assignment_name_len(c->assignments[a]) == len &&
+                 memcmp(c->assignments[a], *e, len) == 0))
+            ++a;
+        if (a == c->n_assignments)
+            result[n++] = *e;
+    }
+    memcpy(result + n, c->assignments, c->n_assignments * sizeof(char *));
+    result[n + c->n_assignments] = 0;
+    return result;
+}
+
+void assign_variables(const command_t *const c) {
+    for (int a = 0; a < c->n_assignments; ++a) {
+        const char *const word = c->assignments[a];
+        const size_t len = assignment_name_len(word);
+        var_set(word, len, word + len + 1, 0);
+    }
+}
+
+/* Command hash table: maps the names of commands (without a '/') to the
+ * pathnames found by searching PATH, so that children can exec them directly
+ * instead of probing every directory of PATH. The table is emptied whenever
+ * PATH changes.
+ */
+typedef struct hash_entry {
+        struct hash_entry *next;
+        char *name, *pathname;
+        unsigned hits;
+} hash_entry_t;
+
+static struct {
+        hash_entry_t **buckets;
+        int n_buckets, n_entries;
+        char *path; // value of PATH when the entries were searched
+} command_hash;
+
+static const char *const DEFAULT_PATH = "/bin:/usr/bin"; // same as execvp
+
+char *search_path(const char *const name) {
+    /* Returns the pathname (allocated via malloc) of the first executable
+     * regular file called name in the directories of PATH, 0 if none */
+    const char *path = var_get("PATH");
+    if (!path)
+        path = DEFAULT_PATH;
+    const size_t name_len = strlen(name);
+    char *const buf = my_malloc(strlen(path) + name_len + 3);
+    for (const char *dir = path;;) {
+        const char *const end = strchrnul(dir, ':');
+        size_t len = end - dir;
+        if (len) {
+            memcpy(buf, dir, len);
+        } else { // an empty entry means the current directory
+            buf[0] = '.';
+            len = 1;
+        }
+        buf[len] = '/';
+        memcpy(buf + len + 1, name, name_len + 1);
+        struct stat st;
+        if (access(buf, X_OK) == 0 && stat(buf, &st) == 0 &&
+            S_ISREG(st.st_mode))
+            return buf;
+        if (!*end)
+            break;
+        dir = end + 1;
+    }
+    free(buf);
+    return 0;
+}
+
+void hash_reset(void) {
+    for (int b = 0; b < command_hash.n_buckets; ++b) {
+        hash_entry_t *e = command_hash.buckets[b];
+        while (e) {
+            hash_entry_t *const next = e->next;
+            free(e->name);
+            free(e->pathname);
+            free(e);
+            e = next;
+        }
+        command_hash.buckets[b] = 0;
+    }
+    command_hash.n_entries = 0;
+}
+
+hash_entry_t **hash_find(const char *const name) {
+    /* Returns the link pointing to the entry for name, or to the 0 ending its
+     * bucket; the table is emptied first if PATH changed */
+    const char *path = var_get("PATH");
+    if (!path)
+        path = DEFAULT_PATH;
+    if (!command_hash.path || strcmp(command_hash.path, path)) {
+        hash_reset();
+        free(command_hash.path);
+        command_hash.path = my_strdup(path);
+    }
+    if (!command_hash.n_buckets) {
+        command_hash.n_buckets = 64;
+        command_hash.buckets =
+            my_malloc(command_hash.n_buckets * sizeof(hash_entry_t *));
+        memset(command_hash.buckets, 0,
+               command_hash.n_buckets * sizeof(hash_entry_t *));
+    }
+    hash_entry_t **link =
+        &command_hash
+             .buckets[hash_string(name) & (command_hash.n_buckets - 1)];
+    while (*link && strcmp((*link)->name, name))
+        link = &(*link)->next;
+    return link;
+}
+
+void hash_grow(void) {
+    const int n_buckets = 2 * command_hash.n_buckets;
+    hash_entry_t **const buckets = my_malloc(n_buckets * sizeof(*buckets));
+    memset(buckets, 0, n_buckets * sizeof(*buckets));
+    for (int b = 0; b < command_hash.n_buckets; ++b) {
+        hash_entry_t *e = command_hash.buckets[b];
+        while (e) {
+            hash_entry_t *const next = e->next;
+            hash_entry_t **const bucket =
+                &buckets[hash_string(e->name) & (n_buckets - 1)];
+            e->next = *bucket;
+            *bucket = e;
+            e = next;
+        }
+    }
+    free(command_hash.buckets);
+    command_hash.buckets = buckets;
+    command_hash.n_buckets = n_buckets;
+}
+
+hash_entry_t *hash_enter(const char *const name, int *const cached) {
+    /* Returns the entry for the command name, searching PATH if it is not in
+     * the table yet (*cached tells which), or 0 if it cannot be found */
+    hash_entry_t **const link = hash_find(name);
+    *cached = *link != 0;
+    if (*cached)
+        return *link;
+    char *const pathname = search_path(name);
+    if (!pathname)
+        return 0;
+    hash_entry_t *const e = my_malloc(sizeof(*e));
+    e->next = 0;
+    e->name = my_strdup(name);
+    e->pathname = pathname;
+    e->hits = 0;
+    *link = e;
+    if (++command_hash.n_entries > command_hash.n_buckets)
+        hash_grow();
+    return e;
+}
+
+const char *hash_lookup(const char *const name, int *const cached) {
+    /* Returns the pathname to exec for the command name, or 0 (with errno set
+     * to ENOENT) if it cannot be found in PATH */
+    *cached = 0;
+    if (strchr(name, '/'))
+        return name;
+    hash_entry_t *const e = hash_enter(name, cached);
+    if (!e) {
+        errno = ENOENT;
+        return 0;
+    }
+    ++e->hits;
+    return e->pathname;
+}
+
+void hash_forget(const char *const name) {
+    hash_entry_t **const link = hash_find(name);
+    hash_entry_t *const e = *link;
+    if (e) {
+        *link = e->next;
+        free(e->name);
+        free(e->pathname);
+        free(e);
+        --command_hash.n_entries;
+    }
+}
+
+int hash_builtin(const command_t *const c, int in, int out) {
+    /* hash: show the table; hash -r: empty it; hash name...: search PATH
+     * for the given names and remember them */
+    if (c->n_args == 1) {
+        if (!command_hash.n_entries) {
+            dprintf(out, "hash: hash table empty\n");
+            return 0;
+        }
+        dprintf(out, "hits\tcommand\n");
+        for (int b = 0; b < command_hash.n_buckets; ++b)
+            for (const hash_entry_t *e = command_hash.buckets[b]; e;
+                 e = e->next)
+                dprintf(out, "%4u\t%s\n", e->hits, e->pathname);
+        return 0;
+    }
+    int status = 0;
+    for (int a = 1; a < c->n_args; ++a) {
+        if (strcmp(c->args[a], "-r") == 0) {
+            hash_reset();
+        } else {
+            int cached;
+            if (strchr(c->args[a], '/') || !hash_enter(c->args[a], &cached)) {
+                fprintf(stderr, "hash: %s: not found\n", c->args[a]);
+                status = 1;
+            }
+        }
+    }
+    return status;
+}
+
+void redirect(int from_fd, int to_fd) {
+    /* If from_fd!=NO_REDIR, then the corresponding open file should be
+     * "moved" to to_fd. That is, use dup/dup2/close to make to_fd
+     * equivalent to the original from_fd, and then close from_fd
+     */
+    /*** TO BE DONE START ***/
+    if (from_fd != NO_REDIR && from_fd != to_fd) {
+        if (dup2(from_fd, to_fd) == -1) {
+            fatal_errno("dup2 failed");
+        }
+
+        if (close(from_fd) == -1) {
+            fatal_errno("close failed");
+        }
+    }
+    /*** TO BE DONE END ***/
+}
+
+#ifndef USE_FORK
+void spawn_redirect(posix_spawn_file_actions_t *const actions, int from_fd,
+                    int to_fd) {
+    /* Same as redirect, but recorded as file actions that posix_spawn
+     * performs in the child, between its creation and the exec
+     */
+    if (from_fd != NO_REDIR && from_fd != to_fd) {
+        int rv = posix_spawn_file_actions_adddup2(actions, from_fd, to_fd);
+        if (!rv)
+            rv = posix_spawn_file_actions_addclose(actions, from_fd);
+        if (rv) {
+            errno = rv;
+            fatal_errno("posix_spawn_file_actions");
+        }
+    }
+}
+#endif
+
+void redirect_stderr(int c_stderr) {
+    /* Like redirect, to STDERR_FILENO; for ERR_TO_OUT, once the stdout of
+     * the command is in place */
+    if (c_stderr == ERR_TO_OUT) {
+        if (dup2(STDOUT_FILENO, STDERR_FILENO) == -1)
+            fatal_errno("dup2 failed");
+    } else {
+        redirect(c_stderr, STDERR_FILENO);
+    }
+}
+
+#ifndef USE_FORK
+void spawn_redirect_stderr(posix_spawn_file_actions_t *const actions,
+                           int c_stderr) {
+    if (c_stderr != ERR_TO_OUT) {
+        spawn_redirect(actions, c_stderr, STDERR_FILENO);
+        return;
+    }
+    const int rv = posix_spawn_file_actions_adddup2(actions, STDOUT_FILENO,
+                                                    STDERR_FILENO);
+    if (rv) {
+        errno = rv;
+        fatal_errno("posix_spawn_file_actions");
+    }
+}
+#endif
+
+void default_signals(void) {
+    /* In a child: puts back the signals that the server ignores */
+    signal(SIGPIPE, SIG_DFL);
+}
+
+void apply_limits(const command_t *const c) {
+    /* In a child: applies the @ prefixes of c to itself */
+    cpu_set_t set;
+    if (c->cpus && (parse_cpus(c->cpus, &set) ||
+                    sched_setaffinity(0, sizeof(set), &set)))
+        fatal_errno("@cpu");
+    if (c->has_nice && setpriority(PRIO_PROCESS, 0, c->nice))
+        fatal_errno("@nice");
+    // the last one, as mmap, so malloc, can fail after it (with ASan, always)
+    const struct rlimit limit = {c->mem, c->mem};
+    if (c->mem && setrlimit(RLIMIT_AS, &limit))
+        fatal_errno("@mem");
+}
+
+#ifndef USE_FORK
+pid_t spawn_child(const command_t *const c, const char *pathname, int cached,
+                  int c_stdin, int c_stdout, int c_stderr) {
+    // posix_spawn does not copy the page tables of the shell (glibc uses
+    // clone(CLONE_VM|CLONE_VFORK)), which matters with the ASan shadow memory
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int rv = posix_spawn_file_actions_init(&actions);
+    if (rv) {
+        errno = rv;
+        fatal_errno("posix_spawn_file_actions_init");
+    }
+    spawn_redirect(&actions, c_stdin, STDIN_FILENO);
+    spawn_redirect(&actions, c_stdout, STDOUT_FILENO);
+    spawn_redirect_stderr(&actions, c_stderr);
+    posix_spawnattr_t attr;
+    sigset_t defaults; // see default_signals
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    if ((rv = posix_spawnattr_init(&attr)) ||
+        (rv = posix_spawnattr_setsigdefault(&attr, &defaults)) ||
+        (rv = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF))) {
+        errno = rv;
+        fatal_errno("posix_spawnattr");
+    }
+    char *const *const envp = command_envp(c);
+    TRACE_BEGIN("posix_spawn", 0);
+    rv = posix_spawn(&pid, pathname, &actions, &attr, c->args, envp);
+    if (rv == ENOENT && cached) {
+        // the command moved or was removed since it was hashed
+        hash_forget(c->args[0]);
+        if ((pathname = hash_lookup(c->args[0], &cached)))
+            rv = posix_spawn(&pid, pathname, &actions, &attr, c->args, envp);
+    }
+    TRACE_END("posix_spawn", rv ? -rv : pid);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rv) {
+        // unlike fork+exec, a failed exec is reported here, in the parent
+        errno = rv;
+        perror(c->args[0]);
+        return 0;
+    }
+    return pid;
+}
+#endif
+
+pid_t run_child(const command_t *const c, int c_stdin, int c_stdout,
+                int c_stderr) {
+    /* This function must:
+     * 1) create a child process, then, in the child
+     * 2) redirect c_stdin to STDIN_FILENO (=0)
+     * 3) redirect c_stdout to STDOUT_FILENO (=1)
+     * 4) execute the command specified in c->args[0] with the corresponding
+     * arguments c->args (printing error messages in case of failure,
+     * obviously)
+     */
+    /*** TO BE DONE START ***/
+    int cached;
+    const char *pathname = hash_lookup(c->args[0], &cached);
+    if (!pathname) {
+        perror(c->args[0]);
+        return 0;
+    }
+#ifndef USE_FORK
+    // posix_spawn has no attributes for the @ prefixes: those are forked
+    if (!has_limits(c))
+        return spawn_child(c, pathname, cached, c_stdin, c_stdout, c_stderr);
+#endif
+    TRACE_BEGIN("fork", 0);
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        fatal_errno("fork failed on run_child");
+    }
+    if (pid)
+        TRACE_END("fork", pid);
+
+    if (pid == 0) {
+        default_signals();
+        redirect(c_stdin, STDIN_FILENO);
+        redirect(c_stdout, STDOUT_FILENO);
+        redirect_stderr(c_stderr);
+        environ = command_envp(c); // before @mem, as it allocates
+        apply_limits(c);
+        execv(pathname, c->args);
+        // a stale hash entry: fall back to searching PATH (on the stack, so
+        // even under @mem)
+        if (errno == ENOENT && cached)
+            execvp(c->args[0], c->args);
+        // if exec return, an error occurred
+        fatal_errno(c->args[0]);
+    }
+    /*** TO BE DONE END ***/
+    return pid;
+}
+
+/* The current directory is kept by the shell, so that the prompt costs no
+ * getcwd (which can stall on network filesystems): it is logical, like $PWD
+ * in POSIX shells, i.e. "cd link/.." goes back to where "cd link" started.
+ */
+static struct {
+        char *path;
+        size_t size;         // of the buffer path, reused by set_cwd
+        unsigned long changes;
+} cwd;
+
+void set_cwd(const char *const path) {
+    const size_t len = strlen(path);
+    if (len + 1 > cwd.size)
+        cwd.path = my_realloc(cwd.path, cwd.size = len + 1);
+    memcpy(cwd.path, path, len + 1);
+    ++cwd.changes;
+    var_set("PWD", 3, path, 0);
+}
+
+void refresh_cwd(void) {
+    /* Asks the kernel: only at startup, or when the logical path is lost */
+    char *const path = getcwd(NULL, 0);
+    if (!path) {
+        perror("getcwd");
+        set_cwd(".");
+        return;
+    }
+    set_cwd(path);
+    free(path);
+}
+
+void init_cwd(void) {
+    /* Like POSIX shells, trusts $PWD if it is absolute and names "." */
+    const char *const pwd = var_get("PWD");
+    struct stat pwd_st, dot_st;
+    if (pwd && *pwd == '/' && stat(pwd, &pwd_st) == 0 &&
+        stat(".", &dot_st) == 0 && pwd_st.st_dev == dot_st.st_dev &&
+        pwd_st.st_ino == dot_st.st_ino)
+        set_cwd(pwd);
+    else
+        refresh_cwd();
+}
+
+char *logical_path(const char *const dir) {
+    /* Returns (in line_arena) the absolute pathname of dir, relative to the
+     * current directory, without ".", ".." and repeated slashes; cwd.path
+     * must be absolute if dir is not */
+    const size_t cwd_len = *dir == '/' ? 0 : strlen(cwd.path);
+    char *const path = arena_alloc(&line_arena, cwd_len + strlen(dir) + 2);
+    size_t len = 0;
+    for (int part = *dir == '/'; part < 2; ++part) {
+        const char *p = part ? dir : cwd.path;
+        while (*p) {
+            while (*p == '/')
+                ++p;
+            const size_t n = strcspn(p, "/");
+            if (n == 2 && p[0] == '.' && p[1] == '.') // drop the last one
+                while (len && path[--len] != '/')
+                    ;
+            else if (n && !(n == 1 && *p == '.')) {
+                path[len++] = '/';
+                memcpy(path + len, p, n);
+                len += n;
+            }
+            p += n;
+        }
+    }
+    if (!len)
+        path[len++] = '/';
+    path[len] = 0;
+    return path;
+}
+
+int change_current_directory(char *newdir) {
+    /* Change the current working directory to newdir
+     * (printing an appropriate error message if the syscall fails)
+     */
+    // after a getcwd failure cwd.path is ".": only the physical way is left
+    if (*newdir == '/' || *cwd.path == '/') {
+        char *const path = logical_path(newdir);
+        if (chdir(path) == 0) {
+            set_cwd(path);
+            return 0;
+        }
+    }
+    /*** TO BE DONE START ***/
+    if (chdir(newdir) == -1) {
+        perror("error in change directory");
+        return -1;
+    }
+    /*** TO BE DONE END ***/
+    // only reachable physically, e.g. ".." of a directory that was moved
+    refresh_cwd();
+    return 0;
+}
+
+void close_if_needed(int fd) {
+    if (fd == NO_REDIR || fd == ERR_TO_OUT)
+        return; // nothing to do
+    if (close(fd))
+        perror("close in close_if_needed");
+}
+
+void close_fds(int *const fds, int n_fds) {
+    for (int f = 0; f < n_fds; ++f) {
+        close_if_needed(fds[f]);
+        fds[f] = NO_REDIR;
+    }
+}
+
+/* History of the interactive lines, persisted to $HISTFILE (by default
+ * ~/.microbash_history): each line is appended to the file as soon as it is
+ * entered, and the file is mmap'ed at startup, its entries pointing straight
+ * into the mapping, so that loading costs no copy. A line entered again
+ * replaces its older copy, found through a hash index; the file is
+ * compacted at startup, when the dead copies outnumber the live ones.
+ * Searches go through the live entries, newest first (substrings, via
+ * memmem) or through a sorted index, built when needed (prefixes).
+ */
+typedef struct {
+        const char *text; // not NUL-terminated, when in the mapping
+        uint32_t len;
+        int alive; // not replaced by a newer copy
+} hist_entry_t;
+
+static struct {
+        hist_entry_t *entries;
+        int n_entries, capacity, n_alive;
+        int *index; // open addressing: the number of an entry + 1, 0 if free
+        int index_size;
+        int *sorted; // of the live entries, by text; 0 when out of date
+        const char *map;
+        size_t map_size;
+        int fd; // the file, opened O_APPEND, or -1
+} history = {.fd = -1};
+
+static const char *const HISTORY_FILE = ".microbash_history"; // in HOME
+#ifndef NO_READLINE
+static const int HISTORY_READLINE_MAX = 1000; // entries for the arrow keys
+#endif
+
+int *hist_slot(const char *const text, uint32_t len) {
+    /* Returns the slot of the index for text: the one of its live entry, or
+     * a free one */
+    unsigned i = hash_bytes(text, len) & (history.index_size - 1);
+    for (;; i = (i + 1) & (history.index_size - 1)) {
+        const int e = history.index[i] - 1;
+        if (e < 0 || (history.entries[e].len == len &&
+                      memcmp(history.entries[e].text, text, len) == 0))
+            return &history.index[i];
+    }
+}
+
+void hist_grow_index(void) {
+    const int *const old = history.index;
+    const int old_size = history.index_size;
+    history.index_size = old_size ? 2 * old_size : 1024;
+    history.index = my_malloc(history.index_size * sizeof(int));
+    memset(history.index, 0, history.index_size * sizeof(int));
+    for (int i = 0; i < old_size; ++i)
+        if (old[i]) {
+            const hist_entry_t *const e = &history.entries[old[i] - 1];
+            *hist_slot(e->text, e->len) = old[i];
+        }
+    free((void *)old);
+}
+
+void hist_enter(const char *const text, uint32_t len) {
+    if (2 * (history.n_alive + 1) > history.index_size)
+        hist_grow_index();
+    if (history.n_entries == history.capacity)
+        history.entries = my_realloc(
+            history.entries,
+            (history.capacity = 2 * history.capacity + 1024) *
+                sizeof(hist_entry_t));
+    int *const slot = hist_slot(text, len);
+    if (*slot)
+        history.entries[*slot - 1].alive = 0;
+    else
+        ++history.n_alive;
+    hist_entry_t *const e = &history.entries[history.n_entries++];
+    e->text = text;
+    e->len = len;
+    e->alive = 1;
+    *slot = history.n_entries;
+    free(history.sorted);
+    history.sorted = 0;
+}
+
+char *history_pathname(void) {
+    /* Returns the pathname of the history file in line_arena, 0 if none */
+    const char *const file = var_get("HISTFILE");
+    if (file)
+        return *file ? arena_strdup(&line_arena, file) : 0;
+    const char *const home = var_get("HOME");
+    return home ? arena_printf(&line_arena, "%s/%s", home, HISTORY_FILE) : 0;
+}
+
+void compact_history(const char *const pathname) {
+    /* Rewrites the file with the live entries only; the mapping stays valid,
+     * as the new file replaces the old one by rename */
+    char *const tmp = arena_printf(&line_arena, "%s.%d", pathname, shell.pid);
+    FILE *const f = fopen(tmp, "we");
+    if (!f)
+        return;
+    for (int i = 0; i < history.n_entries; ++i) {
+        const hist_entry_t *const e = &history.entries[i];
+        if (e->alive)
+            fprintf(f, "%.*s\n", (int)e->len, e->text);
+    }
+    if (fclose(f) || rename(tmp, pathname)) {
+        perror(pathname);
+        unlink(tmp);
+    }
+}
+
+void load_history(void) {
+    const char *const pathname = history_pathname();
+    if (!pathname)
+        return;
+    const int fd = open(pathname, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        perror(pathname);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    if (st.st_size) {
+        void *const map =
+            mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            perror(pathname);
+            close(fd);
+            return;
+        }
+        history.map = map;
+        history.map_size = st.st_size;
+        const char *p = history.map, *const end = p + history.map_size;
+        while (p < end) {
+            const char *nl = memchr(p, '\n', end - p);
+            if (!nl)
+                nl = end;
+            if (nl > p)
+                hist_enter(p, nl - p);
+            p = nl + 1;
+        }
+    }
+    close(fd);
+    if (history.n_entries - history.n_alive > history.n_alive)
+        compact_history(pathname);
+    history.fd = open(pathname, O_WRONLY | O_APPEND | O_CLOEXEC);
+#ifndef NO_READLINE
+    int i = history.n_entries, n = 0;
+    while (i > 0 && n < HISTORY_READLINE_MAX)
+        n += history.entries[--i].alive;
+    for (; i < history.n_entries; ++i) {
+        const hist_entry_t *const e = &history.entries[i];
+        if (e->alive)
+            add_history(arena_printf(&line_arena, "%.*s", (int)e->len,
+                                     e->text));
+    }
+#endif
+    arena_reset(&line_arena);
+}
+
+void remember_line(const char *const line) {
+    /* Adds line to the history, and to its file */
+    const size_t len = strlen(line);
+    if (!len)
+        return;
+    hist_enter(my_strdup(line), len);
+#ifndef NO_READLINE
+    add_history(line);
+#endif
+    if (history.fd >= 0) {
+        const char *const text = arena_printf(&line_arena, "%s\n", line);
+        if (write(history.fd, text, len + 1) < 0)
+            perror("history");
+    }
+}
+
+int compare_entries(const void *a, const void *b) {
+    const hist_entry_t *const x = &history.entries[*(const int *)a],
+                             *const y = &history.entries[*(const int *)b];
+    const int rv = memcmp(x->text, y->text, x->len < y->len ? x->len : y->len);
+    return rv ? rv : (x->len > y->len) - (x->len < y->len);
+}
+
+int history_builtin(const command_t *const c, int in, int out) {
+    /* history [N]: the last N entries (all by default); history -s TEXT:
+     * the entries containing TEXT, newest first; history -p PREFIX: the
+     * entries starting with PREFIX, sorted */
+    FILE *const f = fdopen(dup(out), "w");
+    if (!f) {
+        perror("history");
+        return 1;
+    }
+    fflush(stdout);
+    int status = 0;
+    if (c->n_args == 3 && strcmp(c->args[1], "-s") == 0) {
+        const char *const text = c->args[2];
+        const size_t len = strlen(text);
+        for (int i = history.n_entries; i-- > 0;) {
+            const hist_entry_t *const e = &history.entries[i];
+            if (e->alive && memmem(e->text, e->len, text, len))
+                fprintf(f, "%5d  %.*s\n", i + 1, (int)e->len, e->text);
+        }
+    } else if (c->n_args == 3 && strcmp(c->args[1], "-p") == 0) {
+        if (!history.sorted) {
+            history.sorted = my_malloc((history.n_alive + 1) * sizeof(int));
+            int n = 0;
+            for (int i = 0; i < history.n_entries; ++i)
+                if (history.entries[i].alive)
+                    history.sorted[n++] = i;
+            qsort(history.sorted, n, sizeof(int), compare_entries);
+        }
+        const char *const prefix = c->args[2];
+        const size_t len = strlen(prefix);
+        // binary search of the first entry not below prefix
+        int lo = 0, hi = history.n_alive;
+        while (lo < hi) {
+            const int mid = lo + (hi - lo) / 2;
+            const hist_entry_t *const e = &history.entries[history.sorted[mid]];
+            const int rv =
+                memcmp(e->text, prefix, e->len < len ? e->len : len);
+            if (rv < 0 || (!rv && e->len < len))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (; lo < history.n_alive; ++lo) {
+            const int i = history.sorted[lo];
+            const hist_entry_t *const e = &history.entries[i];
+            if (e->len < len || memcmp(e->text, prefix, len))
+                break;
+            fprintf(f, "%5d  %.*s\n", i + 1, (int)e->len, e->text);
+        }
+    } else if (c->n_args <= 2) {
+        char *end = "";
+        long n = c->n_args == 2 ? strtol(c->args[1], &end, 10) : LONG_MAX;
+        if (*end || n < 0) {
+            fprintf(stderr, "Usage: history [N | -s TEXT | -p PREFIX]\n");
+            status = 1;
+        }
+        int i = history.n_entries;
+        while (!status && i > 0 && n > 0)
+            n -= history.entries[--i].alive;
+        for (; !status && i < history.n_entries; ++i) {
+            const hist_entry_t *const e = &history.entries[i];
+            if (e->alive)
+                fprintf(f, "%5d  %.*s\n", i + 1, (int)e->len, e->text);
+        }
+    } else {
+        fprintf(stderr, "Usage: history [N | -s TEXT | -p PREFIX]\n");
+        status = 1;
+    }
+    if (fclose(f)) {
+        perror("history");
+        status = 1;
+    }
+    return status;
+}
+
+/* Builtins run inside the shell, without any exec. A builtin reads its input
+ * from the file-descriptor in, writes its output to the file-descriptor out
+ * and returns its exit-status.
+ */
+typedef int (*builtin_fn_t)(const command_t *c, int in, int out);
+
+typedef enum {
+    BUILTIN_ANYWHERE = 0,
+    BUILTIN_ALONE = 1 // works on the state of the shell: no pipe, no redir.
+} builtin_flags_t;
+
+typedef struct {
+        const char *name;
+        builtin_fn_t run;
+        builtin_flags_t flags;
+} builtin_t;
+
+int write_all(int fd, const char *buf, size_t len) {
+    while (len) {
+        const ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int cd_builtin(const command_t *const c, int in, int out) {
+    if (c->n_args != 2) { // see check_cd
+        fprintf(stderr, "cd: wrong number of arguments\n");
+        return 1;
+    }
+    return change_current_directory(c->args[1]) ? 1 : 0;
+}
+
+int echo_builtin(const command_t *const c, int in, int out) {
+    int a = 1, newline = 1;
+    if (a < c->n_args && strcmp(c->args[a], "-n") == 0) {
+        newline = 0;
+        ++a;
+    }
+    // a single write, as the output may be shared with other processes
+    size_t len = newline;
+    for (int i = a; i < c->n_args; ++i)
+        len += strlen(c->args[i]) + 1;
+    char *const buf = arena_alloc(&line_arena, len), *p = buf;
+    for (int i = a; i < c->n_args; ++i) {
+        if (i > a)
+            *p++ = ' ';
+        p = stpcpy(p, c->args[i]);
+    }
+    if (newline)
+        *p++ = '\n';
+    if (write_all(out, buf, p - buf)) {
+        perror("echo");
+        return 1;
+    }
+    return 0;
+}
+
+int exit_builtin(const command_t *const c, int in, int out) {
+    if (c->n_args > 2) {
+        fprintf(stderr, "exit: too many arguments\n");
+        return 1;
+    }
+    long status = shell.last_status;
+    if (c->n_args == 2) {
+        char *end;
+        errno = 0;
+        status = strtol(c->args[1], &end, 10);
+        if (!*c->args[1] || *end || errno) {
+            fprintf(stderr, "exit: %s: numeric argument required\n",
+                    c->args[1]);
+            return 2;
+        }
+    }
+    shell.exit_requested = 1;
+    shell.exit_status = status & 0xff;
+    return shell.exit_status;
+}
+
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int export_builtin(const command_t *const c, int in, int out) {
+    /* export NAME[=value]...: export shell variables, so that they are
+     * inherited by the children; with no arguments, list them */
+    if (c->n_args == 1) {
+        char *const *const exported = exported_envp();
+        int n = 0; // those with no value yet are not there
+        while (exported[n])
+            ++n;
+        const char **const envp = my_malloc(n * sizeof(char *));
+        memcpy(envp, exported, n * sizeof(char *));
+        qsort(envp, n, sizeof(char *), compare_strings);
+        for (int e = 0; e < n; ++e)
+            dprintf(out, "export %s\n", envp[e]);
+        free(envp);
+        return 0;
+    }
+    int status = 0;
+    for (int a = 1; a < c->n_args; ++a) {
+        const char *const arg = c->args[a];
+        const size_t len = identifier_len(arg);
+        if (!len || (arg[len] && arg[len] != '=')) {
+            fprintf(stderr, "export: '%s': not a valid identifier\n", arg);
+            status = 1;
+        } else {
+            var_set(arg, len, arg[len] ? arg + len + 1 : 0, 1);
+        }
+    }
+    return status;
+}
+
+int false_builtin(const command_t *const c, int in, int out) { return 1; }
+
+int pwd_builtin(const command_t *const c, int in, int out) {
+    // the cached logical path, like "pwd -L" in POSIX shells
+    if (dprintf(out, "%s\n", cwd.path) < 0) {
+        perror("pwd");
+        return 1;
+    }
+    return 0;
+}
+
+int true_builtin(const command_t *const c, int in, int out) { return 0; }
+
+int unset_builtin(const command_t *const c, int in, int out) {
+    int status = 0;
+    for (int a = 1; a < c->n_args; ++a) {
+        if (!is_identifier(c->args[a])) {
+            fprintf(stderr, "unset: '%s': not a valid identifier\n",
+                    c->args[a]);
+            status = 1;
+        } else {
+            var_unset(c->args[a]);
+        }
+    }
+    return status;
+}
+
+int parse_size(const char *const s, unsigned long long *const size) {
+    /* Parses a number of bytes, with an optional K, M or G suffix */
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (errno || end == s || *s == '-')
+        return -1;
+    int units = 0; // of 1024
+    switch (*end) {
+    case 'G':
+    case 'g':
+        ++units;
+        /* fall through */
+    case 'M':
+    case 'm':
+        ++units;
+        /* fall through */
+    case 'K':
+    case 'k':
+        ++units;
+        ++end;
+    }
+    if (*end)
+        return -1;
+    for (; units; --units) {
+        if (n > ULLONG_MAX / 1024)
+            return -1;
+        n *= 1024;
+    }
+    *size = n;
+    return 0;
+}
+
+/* Cache of the lines parsed and checked already, looked up by their raw text
+ * (hashed before parse_line tokenizes it in place), so that the lines a
+ * script runs over and over skip parse_line and check_line. Each entry is a
+ * single block holding its text and a copy of its line_t, with every pointer
+ * into the block itself. $VAR words and patterns are stored as they are:
+ * they are bound right before each run (see expand_command), so a cached
+ * line is a template. The least recently used entries are dropped first.
+ */
+typedef struct line_entry {
+        struct line_entry *next;          // in the same bucket
+        struct line_entry *older, *newer; // LRU list
+        uint64_t hash;
+        char *text;
+        line_t *line;
+        int users; // running it, which cannot be dropped meanwhile
+} line_entry_t;
+
+#define LINE_CACHE_BUCKETS 256
+
+static struct {
+        line_entry_t *buckets[LINE_CACHE_BUCKETS];
+        line_entry_t *newest, *oldest;
+        int n_entries, capacity; // capacity 0 disables the cache
+} line_cache = {.capacity = 128};
+
+static inline size_t blob_align(size_t size) {
+    return (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+}
+
+static inline size_t blob_string_size(const char *const s) {
+    return s ? blob_align(strlen(s) + 1) : 0;
+}
+
+size_t line_size(const line_t *const l) {
+    size_t size = blob_align(sizeof(*l)) +
+                  blob_align(l->n_pipelines * sizeof(pipeline_t *));
+    for (int p = 0; p < l->n_pipelines; ++p) {
+        const pipeline_t *const pl = l->pipelines[p];
+        size += blob_align(sizeof(*pl)) +
+                blob_align(pl->n_commands * sizeof(command_t *));
+        for (int a = 0; a < pl->n_commands; ++a) {
+            const command_t *const c = pl->commands[a];
+            size += blob_align(sizeof(*c)) +
+                    blob_align((c->n_args + 1) * sizeof(char *)) +
+                    blob_string_size(c->in_pathname) +
+                    blob_string_size(c->err_pathname) +
+                    blob_string_size(c->here_string) +
+                    blob_string_size(c->here_document) +
+                    blob_string_size(c->out_pathname) +
+                    blob_string_size(c->cpus);
+            for (int i = 0; i < c->n_args; ++i)
+                size += blob_string_size(c->args[i]);
+        }
+    }
+    return size;
+}
+
+void *blob_copy(char **const p, const void *const src, size_t size) {
+    void *const dst = memcpy(*p, src, size);
+    *p += blob_align(size);
+    return dst;
+}
+
+static inline char *blob_string(char **const p, const char *const s) {
+    return s ? blob_copy(p, s, strlen(s) + 1) : 0;
+}
+
+line_t *clone_line(const line_t *const l, char *p) {
+    /* Copies l to p, which must have room for line_size(l) bytes */
+    line_t *const result = blob_copy(&p, l, sizeof(*l));
+    result->pipelines =
+        blob_copy(&p, l->pipelines, l->n_pipelines * sizeof(pipeline_t *));
+    for (int i = 0; i < l->n_pipelines; ++i) {
+        pipeline_t *const pl = result->pipelines[i] =
+            blob_copy(&p, l->pipelines[i], sizeof(pipeline_t));
+        pl->commands =
+            blob_copy(&p, pl->commands, pl->n_commands * sizeof(command_t *));
+        for (int a = 0; a < pl->n_commands; ++a) {
+            command_t *const c = pl->commands[a] =
+                blob_copy(&p, pl->commands[a], sizeof(command_t));
+            c->args = blob_copy(&p, c->args, (c->n_args + 1) * sizeof(char *));
+            for (int k = 0; k < c->n_args; ++k)
+                c->args[k] = blob_string(&p, c->args[k]);
+            c->in_pathname = blob_string(&p, c->in_pathname);
+            c->err_pathname = blob_string(&p, c->err_pathname);
+            c->here_string = blob_string(&p, c->here_string);
+            c->here_document = blob_string(&p, c->here_document);
+            c->out_pathname = blob_string(&p, c->out_pathname);
+            c->cpus = blob_string(&p, c->cpus);
+        }
+    }
+    return result;
+}
+
+void lru_unlink(line_entry_t *const e) {
+    *(e->newer ? &e->newer->older : &line_cache.newest) = e->older;
+    *(e->older ? &e->older->newer : &line_cache.oldest) = e->newer;
+}
+
+void lru_push(line_entry_t *const e) {
+    e->older = line_cache.newest;
+    e->newer = 0;
+    *(line_cache.newest ? &line_cache.newest->newer : &line_cache.oldest) = e;
+    line_cache.newest = e;
+}
+
+void line_cache_drop(line_entry_t *const e) {
+    line_entry_t **link = &line_cache.buckets[e->hash % LINE_CACHE_BUCKETS];
+    while (*link != e)
+        link = &(*link)->next;
+    *link = e->next;
+    lru_unlink(e);
+    --line_cache.n_entries;
+    free(e);
+}
+
+void line_cache_shrink(int capacity) {
+    /* Drops the least recently used entries, but the running ones, until at
+     * most capacity are left */
+    line_entry_t *e = line_cache.oldest;
+    while (e && line_cache.n_entries > capacity) {
+        line_entry_t *const newer = e->newer;
+        if (!e->users)
+            line_cache_drop(e);
+        e = newer;
+    }
+}
+
+line_entry_t *line_cache_find(const char *const text, uint64_t hash) {
+    line_entry_t *e = line_cache.buckets[hash % LINE_CACHE_BUCKETS];
+    while (e && !(e->hash == hash && strcmp(e->text, text) == 0))
+        e = e->next;
+    if (e && e != line_cache.newest) {
+        lru_unlink(e);
+        lru_push(e);
+    }
+    return e;
+}
+
+line_entry_t *line_cache_enter(const char *const text, uint64_t hash,
+                               const line_t *const l) {
+    line_cache_shrink(line_cache.capacity - 1);
+    const size_t header = blob_align(sizeof(line_entry_t)),
+                 text_size = blob_string_size(text);
+    line_entry_t *const e = my_malloc(header + text_size + line_size(l));
+    e->hash = hash;
+    e->users = 0;
+    char *p = (char *)e + header;
+    e->text = blob_string(&p, text);
+    e->line = clone_line(l, p);
+    line_entry_t **const bucket =
+        &line_cache.buckets[hash % LINE_CACHE_BUCKETS];
+    e->next = *bucket;
+    *bucket = e;
+    lru_push(e);
+    ++line_cache.n_entries;
+    return e;
+}
+
+/* Options of the shell, shown and changed by the builtin set */
+typedef struct {
+        const char *name;
+        int (*set)(const char *value); // 0, -1 if wrong, 1 if reported
+        void (*print)(int out);
+} option_t;
+
+static const char *const PIPE_MAX_SIZE = "/proc/sys/fs/pipe-max-size";
+
+int set_pipe_size(const char *const value) {
+    unsigned long long size, max_size = 0;
+    if (parse_size(value, &size) || size > INT32_MAX)
+        return -1;
+    FILE *const f = fopen(PIPE_MAX_SIZE, "re");
+    if (f) {
+        if (fscanf(f, "%llu", &max_size) != 1)
+            max_size = 0;
+        fclose(f);
+    }
+    if (max_size && size > max_size) {
+        fprintf(stderr, "set: pipesize capped to %llu by %s\n", max_size,
+                PIPE_MAX_SIZE);
+        size = max_size;
+    }
+    shell.pipe_size = size;
+    if (!size)
+        return 0;
+    // the kernel rounds the size up, report what execute_line will get
+    int fds[2];
+    if (pipe(fds))
+        fatal_errno("pipe");
+    const int actual = fcntl(fds[1], F_SETPIPE_SZ, shell.pipe_size);
+    if (actual < 0) {
+        perror("set: F_SETPIPE_SZ");
+        shell.pipe_size = 0;
+    } else {
+        fprintf(stderr, "set: pipes get %d bytes\n", actual);
+        shell.pipe_size = actual;
+    }
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+void print_pipe_size(int out) {
+    dprintf(out, "pipesize=%d\n", shell.pipe_size);
+}
+
+int set_stats_log(const char *const value) {
+    /* Appends a JSON object per process, and one per line, to the file
+     * value; the empty string disables the log */
+    FILE *f = 0;
+    if (*value) {
+        f = fopen(value, "ae");
+        if (!f) {
+            perror(value);
+            return 1;
+        }
+    }
+    if (shell.stats_log)
+        fclose(shell.stats_log);
+    free(shell.stats_log_pathname);
+    shell.stats_log = f;
+    shell.stats_log_pathname = f ? my_strdup(value) : 0;
+    return 0;
+}
+
+void print_stats_log(int out) {
+    dprintf(out, "statslog=%s\n",
+            shell.stats_log_pathname ? shell.stats_log_pathname : "");
+}
+
+int set_pipefail(const char *const value) {
+    if (strcmp(value, "on") == 0)
+        shell.pipefail = 1;
+    else if (strcmp(value, "off") == 0)
+        shell.pipefail = 0;
+    else
+        return -1;
+    return 0;
+}
+
+void print_pipefail(int out) {
+    dprintf(out, "pipefail=%s\n", shell.pipefail ? "on" : "off");
+}
+
+int set_wait_last(const char *const value) {
+    if (strcmp(value, "on") == 0)
+        shell.wait_last = 1;
+    else if (strcmp(value, "off") == 0)
+        shell.wait_last = 0;
+    else
+        return -1;
+    return 0;
+}
+
+void print_wait_last(int out) {
+    dprintf(out, "waitlast=%s\n", shell.wait_last ? "on" : "off");
+}
+
+int set_teardown(const char *const value) {
+    /* off, or a signal given by name (with or without SIG) or number; not
+     * one that stops processes, as they could never be reaped then */
+    if (strcmp(value, "off") == 0) {
+        shell.teardown = 0;
+        return 0;
+    }
+    const char *const name = strncmp(value, "SIG", 3) == 0 ? value + 3 : value;
+    char *end;
+    long sig = strtol(value, &end, 10);
+    if (!*value || *end)
+        for (sig = NSIG - 1; sig > 0; --sig)
+            if (sigabbrev_np(sig) && strcmp(sigabbrev_np(sig), name) == 0)
+                break;
+    if (sig <= 0 || sig >= NSIG || sig == SIGSTOP || sig == SIGTSTP ||
+        sig == SIGTTIN || sig == SIGTTOU)
+        return -1;
+    shell.teardown = sig;
+    return 0;
+}
+
+void print_teardown(int out) {
+    if (shell.teardown)
+        dprintf(out, "teardown=%s\n", sigabbrev_np(shell.teardown));
+    else
+        dprintf(out, "teardown=off\n");
+}
+
+int set_line_cache(const char *const value) {
+    char *end;
+    const long capacity = strtol(value, &end, 10);
+    if (!*value || *end || capacity < 0 || capacity > INT_MAX)
+        return -1;
+    line_cache.capacity = capacity;
+    line_cache_shrink(capacity);
+    return 0;
+}
+
+void print_line_cache(int out) {
+    dprintf(out, "linecache=%d\n", line_cache.capacity);
+}
+
+int set_prealloc(const char *const value) {
+    unsigned long long size;
+    if (parse_size(value, &size) || size > INT64_MAX)
+        return -1;
+    shell.prealloc = size;
+    return 0;
+}
+
+void print_prealloc(int out) {
+    dprintf(out, "prealloc=%lld\n", (long long)shell.prealloc);
+}
+
+static const option_t OPTIONS[] = {
+    {"linecache", set_line_cache, print_line_cache},
+    {"pipefail", set_pipefail, print_pipefail},
+    {"pipesize", set_pipe_size, print_pipe_size},
+    {"prealloc", set_prealloc, print_prealloc},
+    {"statslog", set_stats_log, print_stats_log},
+    {"teardown", set_teardown, print_teardown},
+    {"waitlast", set_wait_last, print_wait_last},
+};
+
+int set_builtin(const command_t *const c, int in, int out) {
+    /* set: show the options; set name=value...: change them */
+    const int n_options = sizeof(OPTIONS) / sizeof(*OPTIONS);
+    if (c->n_args == 1) {
+        for (int o = 0; o < n_options; ++o)
+            OPTIONS[o].print(out);
+        return 0;
+    }
+    int status = 0;
+    for (int a = 1; a < c->n_args; ++a) {
+        const char *const arg = c->args[a], *const eq = strchr(arg, '=');
+        int o = 0;
+        while (o < n_options &&
+               !(eq && strlen(OPTIONS[o].name) == (size_t)(eq - arg) &&
+                 strncmp(OPTIONS[o].name, arg, eq - arg) == 0))
+            ++o;
+        if (o == n_options) {
+            fprintf(stderr, "set: %s: unknown option\n", arg);
+            status = 1;
+        } else {
+            const int e = OPTIONS[o].set(eq + 1);
+            if (e < 0)
+                fprintf(stderr, "set: %s: invalid value\n", arg);
+            if (e)
+                status = 1;
+        }
+    }
+    return status;
+}
+
+job_t *find_job(const char *const spec, int by_pid) {
+    /* Returns the job with id N for spec "%N" (or "N", unless by_pid) or the
+     * job with a process with PID N, if by_pid, printing an error if none */
+    const int by_id = *spec == '%' || !by_pid;
+    char *end;
+    const long n = strtol(spec + (*spec == '%'), &end, 10);
+    if (!*end && end != spec + (*spec == '%'))
+        for (job_t *j = shell.jobs; j; j = j->next) {
+            if (by_id && j->id == n)
+                return j;
+            for (int p = 0; !by_id && p < j->n_procs; ++p)
+                if (j->procs[p].pid == n)
+                    return j;
+        }
+    fprintf(stderr, "%s: no such job\n", spec);
+    return 0;
+}
+
+int wait_for_job(job_t *const j) {
+    /* Moves j from the job table into the foreground, and waits for it */
+    remove_job(j);
+    wait_for_children(j);
+    finish_job(j);
+    const int status = job_status(j);
+    free_job(j);
+    return status;
+}
+
+int fg_builtin(const command_t *const c, int in, int out) {
+    /* fg [%N]: waits for the job N, by default the last one started */
+    if (c->n_args > 2) {
+        fprintf(stderr, "fg: too many arguments\n");
+        return 1;
+    }
+    job_t *j = shell.jobs;
+    if (c->n_args == 2)
+        j = find_job(c->args[1], 0);
+    else if (!j)
+        fprintf(stderr, "fg: no current job\n");
+    else
+        while (j->next)
+            j = j->next;
+    if (!j)
+        return 1;
+    dprintf(out, "%s\n", j->text);
+    return wait_for_job(j);
+}
+
+int jobs_builtin(const command_t *const c, int in, int out) {
+    reap_children(0);
+    for (const job_t *j = shell.jobs; j; j = j->next)
+        dprintf(out, "[%d] Running\t%s\n", j->id, j->text);
+    return 0;
+}
+
+int wait_builtin(const command_t *const c, int in, int out) {
+    /* wait: waits for all the jobs; wait %N|PID...: only for the given ones,
+     * returning the exit-status of the last one */
+    if (c->n_args == 1) {
+        while (shell.jobs)
+            reap_children(-1);
+        return 0;
+    }
+    int status = 0;
+    for (int a = 1; a < c->n_args; ++a) {
+        job_t *const j = find_job(c->args[a], 1);
+        status = j ? wait_for_job(j) : 127;
+    }
+    return status;
+}
+
+line_t *parse_line(char *const line);
+check_t check_line(const line_t *const l);
+job_t *start_background(const line_t *const l, int first, int last);
+
+int parallel_builtin(const command_t *const c, int in, int out) {
+    /* parallel [-j N] [file]: runs the lines of file (by default, of the
+     * input) as background jobs, keeping at most N of them running, then
+     * waits for all of them and reports the throughput
+     */
+    long max_jobs = 4;
+    int a = 1;
+    if (a + 1 < c->n_args && strcmp(c->args[a], "-j") == 0) {
+        char *end;
+        max_jobs = strtol(c->args[a + 1], &end, 10);
+        if (*end || max_jobs < 1) {
+            fprintf(stderr, "parallel: %s: invalid number of jobs\n",
+                    c->args[a + 1]);
+            return 1;
+        }
+        a += 2;
+    }
+    if (a + 1 < c->n_args) {
+        fprintf(stderr, "Usage: parallel [-j N] [file]\n");
+        return 1;
+    }
+    // a script on stdin is read through shell.input, which may have buffered
+    // the lines of the jobs already (like here-documents, see
+    // read_input_line)
+    const int from_input = a == c->n_args && in == STDIN_FILENO &&
+                           shell.input && fileno(shell.input) == in;
+    FILE *const f = a < c->n_args ? fopen(c->args[a], "re")
+                    : from_input  ? shell.input
+                                  : fdopen(dup(in), "r");
+    if (!f) {
+        perror(a < c->n_args ? c->args[a] : "parallel");
+        return 1;
+    }
+    if (shell.parallel.n_running) {
+        fprintf(stderr, "parallel: already running\n");
+        if (!from_input)
+            fclose(f);
+        return 1;
+    }
+    shell.parallel.n_failed = 0;
+    int n_jobs = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char *line = 0;
+    size_t size = 0;
+    ssize_t len;
+    FILE *const input = shell.input; // here-documents are read from f
+    shell.input = f;
+    while ((len = getline(&line, &size, f)) >= 0) {
+        if (len && line[len - 1] == '\n')
+            line[--len] = 0;
+        // the jobs keep copies of what they need, only c lives on
+        const arena_mark_t mark = arena_mark(&line_arena);
+        line_t *const l = parse_line(line);
+        if (l && check_line(l) == CHECK_OK) {
+            while (shell.parallel.n_running >= max_jobs)
+                reap_children(-1);
+            // the whole line is one job
+            job_t *const j = start_background(l, 0, l->n_pipelines - 1);
+            if (j) {
+                j->parallel = 1;
+                ++shell.parallel.n_running;
+                ++n_jobs;
+                add_job(j);
+                if (!j->n_running)
+                    finish_job(j);
+            }
+        }
+        arena_release(&line_arena, mark);
+    }
+    shell.input = input;
+    free(line);
+    if (!from_input)
+        fclose(f);
+    while (shell.parallel.n_running)
+        reap_children(-1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const double seconds = elapsed(&start, &end);
+    fflush(stdout);
+    dprintf(out, "parallel: %d jobs (%d failed) in %.3fs, %.1f jobs/s\n",
+            n_jobs, shell.parallel.n_failed, seconds,
+            seconds > 0 ? n_jobs / seconds : 0);
+    return shell.parallel.n_failed != 0;
+}
+
+static const builtin_t BUILTINS[] = {
+    {"cd", cd_builtin, BUILTIN_ALONE},
+    {"echo", echo_builtin, BUILTIN_ANYWHERE},
+    {"exit", exit_builtin, BUILTIN_ANYWHERE},
+    {"export", export_builtin, BUILTIN_ANYWHERE},
+    {"false", false_builtin, BUILTIN_ANYWHERE},
+    {"fg", fg_builtin, BUILTIN_ALONE},
+    {"hash", hash_builtin, BUILTIN_ALONE},
+    {"history", history_builtin, BUILTIN_ANYWHERE},
+    {"jobs", jobs_builtin, BUILTIN_ANYWHERE},
+    {"parallel", parallel_builtin, BUILTIN_ANYWHERE},
+    {"pwd", pwd_builtin, BUILTIN_ANYWHERE},
+    {"set", set_builtin, BUILTIN_ANYWHERE},
+    {"true", true_builtin, BUILTIN_ANYWHERE},
+    {"unset", unset_builtin, BUILTIN_ANYWHERE},
+    {"wait", wait_builtin, BUILTIN_ALONE},
+};
+
+enum {
+    B_CD,
+    B_ECHO,
+    B_EXIT,
+    B_EXPORT,
+    B_FALSE,
+    B_FG,
+    B_HASH,
+    B_HISTORY,
+    B_JOBS,
+    B_PARALLEL,
+    B_PWD,
+    B_SET,
+    B_TRUE,
+    B_UNSET,
+    B_WAIT
+};
+
+const builtin_t *find_builtin(const char *const name) {
+    /* The first characters select the only candidate, so that a command
+     * that is not a builtin costs at most one strcmp */
+    int b;
+    switch (name[0]) {
+    case 'c':
+        b = B_CD;
+        break;
+    case 'e':
+        if (name[1] == 'c')
+            b = B_ECHO;
+        else if (name[1] == 'x' && name[2] == 'i')
+            b = B_EXIT;
+        else
+            b = B_EXPORT;
+        break;
+    case 'f':
+        b = name[1] == 'g' ? B_FG : B_FALSE;
+        break;
+    case 'h':
+        b = name[1] == 'a' ? B_HASH : B_HISTORY;
+        break;
+    case 'j':
+        b = B_JOBS;
+        break;
+    case 'p':
+        b = name[1] == 'a' ? B_PARALLEL : B_PWD;
+        break;
+    case 's':
+        b = B_SET;
+        break;
+    case 't':
+        b = B_TRUE;
+        break;
+    case 'u':
+        b = B_UNSET;
+        break;
+    case 'w':
+        b = B_WAIT;
+        break;
+    default:
+        return 0;
+    }
+    return strcmp(name, BUILTINS[b].name) == 0 ? &BUILTINS[b] : 0;
+}
+
+check_t check_builtins(const pipeline_t *const l) {
+    assert(l);
+    /* Builtins working on the state of the shell must be the only command of
+     * the line and cannot have I/O redirections (CD has been checked by
+     * check_cd already)
+     */
+    for (int i = 0; i < l->n_commands; ++i) {
+        const command_t *const c = l->commands[i];
+        const int a = command_name_index(c);
+        const builtin_t *const b =
+            a < c->n_args ? find_builtin(c->args[a]) : 0;
+        if (!b || !(b->flags & BUILTIN_ALONE))
+            continue;
+        if (l->n_commands > 1) {
+            fprintf(stderr, "Parsing error: cannot have %s in pipe\n",
+                    b->name);
+            return CHECK_FAILED;
+        }
+        if (has_input(c) || c->out_pathname || c->err_pathname ||
+            c->err_to_out) {
+            fprintf(stderr,
+                    "Parsing error: cannot have I/O redirections with %s\n",
+                    b->name);
+            return CHECK_FAILED;
+        }
+        if (has_limits(c)) {
+            fprintf(stderr, "Parsing error: cannot have @ prefixes with %s\n",
+                    b->name);
+            return CHECK_FAILED;
+        }
+    }
+    return CHECK_OK;
+}
+
+static const struct {
+        const char *name;
+        check_t (*check)(const pipeline_t *const l);
+} CHECKS[] = {
+    {"check_redirections", check_redirections},
+    {"check_cd", check_cd},
+    {"check_builtins", check_builtins},
+};
+
+check_t check_pipeline(const pipeline_t *const l) {
+    for (size_t i = 0; i < sizeof(CHECKS) / sizeof(*CHECKS); ++i) {
+        TRACE_BEGIN(CHECKS[i].name, 0);
+        const check_t rv = CHECKS[i].check(l);
+        TRACE_END(CHECKS[i].name, rv);
+        if (rv != CHECK_OK)
+            return CHECK_FAILED;
+    }
+    return CHECK_OK;
+}
+
+check_t check_line(const line_t *const l) {
+    assert(l);
+    for (int p = 0; p < l->n_pipelines; ++p)
+        if (check_pipeline(l->pipelines[p]) != CHECK_OK)
+            return CHECK_FAILED;
+    return CHECK_OK;
+}
+
+int run_builtin(const builtin_t *const b, const command_t *const c,
+                int c_stdin, int c_stdout, int c_stderr) {
+    /* Runs b in the shell itself: only done for a pipeline of one command,
+     * so that the shell never blocks writing to a pipe nor the rest of a
+     * pipeline changes its state */
+    fflush(stdout); // the builtin writes to the file-descriptor directly
+    const int out = c_stdout == NO_REDIR ? STDOUT_FILENO : c_stdout;
+    // the error messages are written to stderr: move it for the builtin
+    int saved_stderr = NO_REDIR;
+    if (c_stderr != NO_REDIR) {
+        saved_stderr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+        if (saved_stderr < 0 ||
+            dup2(c_stderr == ERR_TO_OUT ? out : c_stderr, STDERR_FILENO) < 0)
+            fatal_errno("dup2 failed");
+    }
+    const int rv =
+        b->run(c, c_stdin == NO_REDIR ? STDIN_FILENO : c_stdin, out);
+    if (saved_stderr != NO_REDIR)
+        redirect(saved_stderr, STDERR_FILENO);
+    return rv;
+}
+
+pid_t fork_builtin(const builtin_t *const b, const command_t *const c,
+                   int *const fds, int *const errs, int n_stages) {
+    /* Runs b in a child process, without exec'ing anything; used inside
+     * pipes, so that the shell does not block writing to them. fds[0] and
+     * fds[1] are the stdin and stdout of c, errs[0] its stderr, the rest of
+     * fds and errs belongs to the next commands (see setup_fds), and the
+     * child must not keep them open.
+     */
+    fflush(stdout);
+    TRACE_BEGIN("fork", 0);
+    const pid_t pid = fork();
+    if (pid < 0)
+        fatal_errno("fork failed on fork_builtin");
+    if (pid)
+        TRACE_END("fork", pid);
+    if (pid == 0) {
+        forget_jobs();
+        default_signals();
+        close_fds(fds + 2, 2 * (n_stages - 1));
+        close_fds(errs + 1, n_stages - 1);
+        if (fds[0] != NO_REDIR)
+            shell.input = 0; // what it has buffered is not on the new stdin
+        redirect(fds[0], STDIN_FILENO);
+        redirect(fds[1], STDOUT_FILENO);
+        redirect_stderr(errs[0]);
+        apply_limits(c);
+        _exit(b->run(c, STDIN_FILENO, STDOUT_FILENO));
+    }
+    return pid;
+}
+
+const char *lookup_variable(const char *const name) {
+    /* Returns the value of the variable name, 0 if unset: the special
+     * parameters are kept by the shell itself, so that testing them costs
+     * no process; the values of $?, $$ and $! are in line_arena */
+    if (name[0] && !name[1])
+        switch (name[0]) {
+        case '?':
+            return arena_printf(&line_arena, "%d", shell.last_status);
+        case '$':
+            return arena_printf(&line_arena, "%d", (int)shell.pid);
+        case '!':
+            return shell.last_background
+                       ? arena_printf(&line_arena, "%d",
+                                      (int)shell.last_background)
+                       : 0;
+        }
+    return var_get(name);
+}
+
+char *expand_word(char *const word) {
+    /* Returns word, or the value of the variable it names if it is a $VAR
+     * (copied into line_arena) */
+    char *tmp = word;
+    if (*tmp == '$') {
+        /* Make tmp point to the value of the corresponding environment
+         * variable, if any, or the empty string otherwise */
+        /*** TO BE DONE START ***/
+        const char *const value = lookup_variable(tmp + 1);
+        tmp = (value == NULL) ? "" : arena_strdup(&line_arena, value);
+        /*** TO BE DONE END ***/
+    }
+    return tmp;
+}
+
+/* Command substitution: $(line) is replaced by the output of line, run by
+ * a forked copy of the shell (like a subshell, its variables are lost, but
+ * no other shell has to start) while this one drains the pipe. Only the
+ * output of the commands is captured: the messages of the copy, like the
+ * reports of wait_for_children, still go to the stdout of the shell.
+ */
+static const size_t SUBSTITUTION_READ_SIZE = 64 * 1024;
+
+void execute_line(const line_t *const l);
+void wait_decompressors(void);
+
+static inline int has_substitution(const char *const word) {
+    return strstr(word, "$(") != 0;
+}
+
+char *read_output(int fd) {
+    /* Reads fd up to the end of file, with large reads into a growing
+     * buffer; returns the text (in line_arena) without trailing newlines */
+    size_t len = 0, size = SUBSTITUTION_READ_SIZE;
+    char *buf = my_malloc(size);
+    for (;;) {
+        if (size - len < SUBSTITUTION_READ_SIZE / 2)
+            buf = my_realloc(buf, size *= 2);
+        const ssize_t n = read(fd, buf + len, size - len - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            fatal_errno("read failed on command substitution");
+        if (!n)
+            break;
+        len += n;
+    }
+    while (len && buf[len - 1] == '\n')
+        --len;
+    char *const text = arena_alloc(&line_arena, len + 1);
+    memcpy(text, buf, len);
+    text[len] = 0;
+    free(buf);
+    return text;
+}
+
+char *run_substitution(const char *const text, size_t len) {
+    /* Returns the output of the line text[0..len) (in line_arena) */
+    char *const copy = arena_printf(&line_arena, "%.*s", (int)len, text);
+    line_t *const l = parse_line(copy); // it tokenizes in place
+    if (!l || check_line(l) != CHECK_OK)
+        return "";
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC))
+        fatal_errno("pipe2");
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (pid < 0)
+        fatal_errno("fork failed on command substitution");
+    if (pid == 0) {
+        forget_jobs();
+        default_signals();
+        const int messages = dup(STDOUT_FILENO);
+        if (messages < 0 || !(stdout = fdopen(messages, "w")))
+            fatal_errno("command substitution");
+        close(fds[0]);
+        redirect(fds[1], STDOUT_FILENO);
+        execute_line(l);
+        fflush(stdout);
+        wait_decompressors();
+        _exit(shell.last_status);
+    }
+    close(fds[1]);
+    char *const output = read_output(fds[0]);
+    close(fds[0]);
+    int status;
+    // only this process is waited for, not the jobs of the shell
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            fatal_errno("waitpid");
+    return output;
+}
+
+char *substitute_commands(const char *const word) {
+    /* Returns word (in line_arena) with each $(...) replaced by the output
+     * of the line inside it; nested ones are replaced when that line runs */
+    size_t len = 0, size = strlen(word) + 1;
+    char *result = my_malloc(size);
+    for (const char *p = word; *p;) {
+        const char *const end = p[0] == '$' && p[1] == '('
+                                    ? skip_substitution((char *)p)
+                                    : 0;
+        const char *const piece = end ? run_substitution(p + 2, end - p - 3)
+                                      : p;
+        const size_t n = end ? strlen(piece) : 1;
+        if (len + n + 1 > size)
+            result = my_realloc(result, size = 2 * (len + n + 1));
+        memcpy(result + len, piece, n);
+        len += n;
+        p = end ? end : p + 1;
+    }
+    result[len] = 0;
+    char *const copy = arena_strdup(&line_arena, result);
+    free(result);
+    return copy;
+}
+
+/* Globbing: the words with a *, ? or [...] are replaced by the pathnames
+ * they match, in order, or left alone if none. Directories are read with
+ * getdents64 into a cache of sorted scans, keyed by pathname and trusted as
+ * long as the mtime of the directory stays the same, so that repeated lines
+ * do not read large directories again and again.
+ */
+typedef struct dir_scan {
+        struct dir_scan *next;
+        char *path;
+        dev_t dev;
+        ino_t ino;
+        struct timespec mtime, scanned; // scanned on CLOCK_REALTIME
+        int n_names;
+        char **names;         // sorted, pointing into buf
+        unsigned char *types; // d_type of names[i], in the same order
+        char *buf;
+} dir_scan_t;
+
+#define DIR_CACHE_BUCKETS 64
+static const int DIR_CACHE_MAX = 256; // scans, before they are all dropped
+static const size_t DIRENT_BUF_SIZE = 256 * 1024;
+
+static struct {
+        dir_scan_t *buckets[DIR_CACHE_BUCKETS];
+        int n_entries;
+} dir_cache;
+
+static inline int is_pattern(const char *const word) {
+    return strpbrk(word, "*?[") != 0;
+}
+
+void free_dir_scan(dir_scan_t *const d) {
+    free(d->path);
+    free(d->names);
+    free(d->types);
+    free(d->buf);
+    free(d);
+}
+
+void dir_cache_flush(void) {
+    for (int b = 0; b < DIR_CACHE_BUCKETS; ++b) {
+        dir_scan_t *d = dir_cache.buckets[b];
+        while (d) {
+            dir_scan_t *const next = d->next;
+            free_dir_scan(d);
+            d = next;
+        }
+        dir_cache.buckets[b] = 0;
+    }
+    dir_cache.n_entries = 0;
+}
+
+int dir_scan_valid(const dir_scan_t *const d, const struct stat *const st) {
+    /* A directory changed in the same tick as its scan could have the same
+     * mtime before and after the change: such scans are never trusted */
+    return d->dev == st->st_dev && d->ino == st->st_ino &&
+           d->mtime.tv_sec == st->st_mtim.tv_sec &&
+           d->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           d->scanned.tv_sec > d->mtime.tv_sec + 1;
+}
+
+const dir_scan_t *scan_dir(const char *const path) {
+    /* Returns the sorted entries of the directory path (except . and ..),
+     * from the cache if still valid, or 0 if it cannot be read */
+    struct stat st;
+    if (stat(path, &st) || !S_ISDIR(st.st_mode))
+        return 0;
+    const unsigned bucket = hash_string(path) & (DIR_CACHE_BUCKETS - 1);
+    dir_scan_t *d = dir_cache.buckets[bucket];
+    while (d && strcmp(d->path, path))
+        d = d->next;
+    if (d && dir_scan_valid(d, &st))
+        return d;
+    const int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    if (!d) {
+        if (dir_cache.n_entries == DIR_CACHE_MAX)
+            dir_cache_flush();
+        d = my_malloc(sizeof(*d));
+        memset(d, 0, sizeof(*d));
+        d->path = my_strdup(path);
+        d->next = dir_cache.buckets[bucket];
+        dir_cache.buckets[bucket] = d;
+        ++dir_cache.n_entries;
+    } else {
+        free(d->names);
+        free(d->types);
+        free(d->buf);
+    }
+    d->dev = st.st_dev;
+    d->ino = st.st_ino;
+    d->mtime = st.st_mtim;
+    clock_gettime(CLOCK_REALTIME, &d->scanned);
+    // the records of getdents64 are packed as they come, one <type, name>
+    // pair each, then indexed and sorted
+    size_t size = DIRENT_BUF_SIZE, used = 0;
+    char *buf = my_malloc(size);
+    void *const dirents = my_malloc(DIRENT_BUF_SIZE);
+    int n_names = 0;
+    ssize_t n;
+    while ((n = getdents64(fd, dirents, DIRENT_BUF_SIZE)) > 0)
+        for (ssize_t off = 0; off < n;) {
+            const struct dirent64 *const e =
+                (const struct dirent64 *)((char *)dirents + off);
+            off += e->d_reclen;
+            const char *const name = e->d_name;
+            if (name[0] == '.' &&
+                (!name[1] || (name[1] == '.' && !name[2])))
+                continue;
+            const size_t len = strlen(name);
+            if (used + len + 2 > size)
+                buf = my_realloc(buf, size *= 2);
+            buf[used] = e->d_type;
+            memcpy(buf + used + 1, name, len + 1);
+            used += len + 2;
+            ++n_names;
+        }
+    if (n < 0)
+        perror(path);
+    close(fd);
+    free(dirents);
+    d->buf = buf;
+    d->n_names = n_names;
+    d->names = my_malloc(n_names * sizeof(char *));
+    d->types = my_malloc(n_names);
+    for (size_t off = 0, i = 0; off < used; off += strlen(buf + off + 1) + 2)
+        d->names[i++] = buf + off + 1;
+    qsort(d->names, n_names, sizeof(char *), compare_strings);
+    for (int i = 0; i < n_names; ++i)
+        d->types[i] = d->names[i][-1];
+    return d;
+}
+
+int is_directory(const char *const path, unsigned char type) {
+    struct stat st;
+    if (type != DT_UNKNOWN && type != DT_LNK)
+        return type == DT_DIR;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+int glob_pathnames(command_t *const c, int *const capacity,
+                   const char *const dir, const char *const pattern) {
+    /* Appends to the arguments of c the pathnames matching dir (empty or
+     * ending with '/') followed by pattern, one component at a time;
+     * returns how many
+     */
+    const char *slash = strchr(pattern, '/');
+    const char *rest = slash;
+    if (rest)
+        while (*rest == '/')
+            ++rest;
+    const char *const component = arena_printf(
+        &line_arena, "%.*s",
+        (int)(slash ? (size_t)(slash - pattern) : strlen(pattern)), pattern);
+    const char *const suffix = slash ? "/" : "";
+    if (!is_pattern(component)) {
+        char *const path =
+            arena_printf(&line_arena, "%s%s%s", dir, component, suffix);
+        if (rest && *rest)
+            return glob_pathnames(c, capacity, path, rest);
+        struct stat st;
+        if (lstat(path, &st))
+            return 0;
+        push_arg(c, capacity, path);
+        return 1;
+    }
+    const dir_scan_t *const d = scan_dir(*dir ? dir : ".");
+    if (!d)
+        return 0;
+    int n = 0;
+    for (int i = 0; i < d->n_names; ++i) {
+        if (fnmatch(component, d->names[i], FNM_PERIOD))
+            continue;
+        char *const path =
+            arena_printf(&line_arena, "%s%s%s", dir, d->names[i], suffix);
+        if (rest && *rest)
+            n += glob_pathnames(c, capacity, path, rest);
+        else if (!slash || is_directory(path, d->types[i])) {
+            push_arg(c, capacity, path);
+            ++n;
+        }
+    }
+    return n;
+}
+
+void glob_word(command_t *const c, int *const capacity, char *const word) {
+    /* Appends to the arguments of c word, or the pathnames it matches */
+    if (is_pattern(word)) {
+        const char *pattern = word;
+        while (*pattern == '/')
+            ++pattern;
+        if (glob_pathnames(c, capacity, pattern == word ? "" : "/", pattern))
+            return;
+    }
+    push_arg(c, capacity, word);
+}
+
+void split_words(command_t *const c, int *const capacity, char *const text) {
+    /* Appends to the arguments of c the words of text, which is the result
+     * of a substitution: they are split at blanks and newlines, and globbed,
+     * but not substituted again */
+    static const char *const SEPARATORS = " \t\n";
+    for (char *w = text + strspn(text, SEPARATORS); *w;) {
+        const size_t n = strcspn(w, SEPARATORS);
+        const int last = !w[n];
+        w[n] = 0;
+        glob_word(c, capacity, w);
+        if (last)
+            break;
+        w += n + 1;
+        w += strspn(w, SEPARATORS);
+    }
+}
+
+const command_t *expand_command(const command_t *const c) {
+    /* Returns c, or a copy of it (allocated in line_arena) with its $VAR and
+     * $(...) arguments expanded, its patterns globbed and its leading
+     * NAME=value words moved from args to assignments */
+    int n_assignments = 0;
+    while (n_assignments < c->n_args &&
+           assignment_name_len(c->args[n_assignments]))
+        ++n_assignments;
+    int a = n_assignments;
+    while (a < c->n_args && *c->args[a] != '$' &&
+           !has_substitution(c->args[a]) && !is_pattern(c->args[a]))
+        ++a;
+    const int expand_here =
+        c->here_string &&
+        (*c->here_string == '$' || has_substitution(c->here_string));
+    if (a == c->n_args && !n_assignments && !expand_here)
+        return c;
+    command_t *const result = arena_alloc(&line_arena, sizeof(*result));
+    *result = *c;
+    if (expand_here)
+        result->here_string = has_substitution(c->here_string)
+                                  ? substitute_commands(c->here_string)
+                                  : expand_word(c->here_string);
+    result->n_args = 0;
+    int capacity = 0;
+    for (a = 0; a < c->n_args; ++a) {
+        char *const word = c->args[a];
+        const size_t len = a < n_assignments ? assignment_name_len(word) : 0;
+        if (has_substitution(word) && !len)
+            split_words(result, &capacity, substitute_commands(word));
+        else if (has_substitution(word)) // NAME=$(...) is not split
+            push_arg(result, &capacity, substitute_commands(word));
+        else if (!len)
+            glob_word(result, &capacity, expand_word(word));
+        else if (word[len + 1] == '$') // NAME=$VAR
+            push_arg(result, &capacity,
+                     arena_printf(&line_arena, "%.*s%s", (int)len + 1, word,
+                                  expand_word(word + len + 1)));
+        else
+            push_arg(result, &capacity, word);
+    }
+    result->n_assignments = n_assignments;
+    result->assignments = result->args;
+    result->args += n_assignments;
+    result->n_args -= n_assignments;
+    return result;
+}
+
+const pipeline_t *expand_pipeline(const pipeline_t *const l) {
+    /* Returns l, or a copy of it (allocated in line_arena) whose commands
+     * have been expanded by expand_command */
+    pipeline_t *result = 0;
+    for (int a = 0; a < l->n_commands; ++a) {
+        const command_t *const c = expand_command(l->commands[a]);
+        if (c == l->commands[a])
+            continue;
+        if (!result) {
+            result = arena_alloc(&line_arena, sizeof(*result));
+            *result = *l;
+            result->commands =
+                arena_alloc(&line_arena, l->n_commands * sizeof(void *));
+            memcpy(result->commands, l->commands,
+                   l->n_commands * sizeof(void *));
+        }
+        result->commands[a] = (command_t *)c;
+    }
+    return result ? result : l;
+}
+
+/* Identity stages: a bare "cat" copies its stdin to its stdout, so inside a
+ * pipe it can simply be dropped, and alone (with an input redirection) the
+ * shell can do the copy itself, in the kernel, without any process.
+ */
+static const char *const CAT = "cat";
+
+int is_identity(const command_t *const c) {
+    return c->n_args == 1 && strcmp(c->args[0], CAT) == 0 &&
+           !c->err_pathname && !c->err_to_out && !has_limits(c);
+}
+
+const pipeline_t *optimize_pipeline(const pipeline_t *const l) {
+    /* Returns l, or a copy of it (allocated in line_arena) without the
+     * identity stages; their redirections move to the new first/last stage
+     */
+    int n_identities = 0;
+    for (int a = 0; a < l->n_commands; ++a)
+        n_identities += is_identity(l->commands[a]);
+    if (!n_identities || l->n_commands == 1)
+        return l;
+    pipeline_t *const result = arena_alloc(&line_arena, sizeof(*result));
+    *result = *l;
+    result->n_commands = 0;
+    result->commands = arena_alloc(&line_arena, l->n_commands * sizeof(void *));
+    for (int a = 0; a < l->n_commands; ++a)
+        if (!is_identity(l->commands[a]))
+            result->commands[result->n_commands++] = l->commands[a];
+    if (!result->n_commands) // only cats: one is enough
+        result->commands[result->n_commands++] = l->commands[0];
+    const command_t *const first = l->commands[0],
+                          *const last = l->commands[l->n_commands - 1];
+    command_t **const new_first = &result->commands[0],
+              **const new_last = &result->commands[result->n_commands - 1];
+    if (has_input(first) && *new_first != first) {
+        command_t *const c = arena_alloc(&line_arena, sizeof(*c));
+        *c = **new_first;
+        c->in_pathname = first->in_pathname;
+        c->in_decompress = first->in_decompress;
+        c->here_string = first->here_string;
+        c->here_document = first->here_document;
+        *new_first = c;
+    }
+    if (last->out_pathname && *new_last != last) {
+        command_t *const c = arena_alloc(&line_arena, sizeof(*c));
+        *c = **new_last;
+        c->out_pathname = last->out_pathname;
+        c->out_append = last->out_append;
+        *new_last = c;
+    }
+    return result;
+}
+
+int copy_fd(int in, int out) {
+    /* Copies in to out, until EOF, without moving the data through user-space
+     * when the kernel can: copy_file_range between files, sendfile from a
+     * file, splice from/to a pipe, or read/write as the last resort. Returns
+     * 0, -1 on errors, or 1 if in is out, which would never reach EOF
+     */
+    enum { COPY_FILE_RANGE, SENDFILE, SPLICE, READ_WRITE } method;
+    static const size_t CHUNK = 1 << 20;
+    struct stat in_st, out_st;
+    if (fstat(in, &in_st) || fstat(out, &out_st))
+        return -1;
+    // in is out, and the copy would feed on itself: cat refuses that too
+    if (S_ISREG(out_st.st_mode) && in_st.st_dev == out_st.st_dev &&
+        in_st.st_ino == out_st.st_ino &&
+        ((fcntl(out, F_GETFL) & O_APPEND) ||
+         lseek(in, 0, SEEK_CUR) < out_st.st_size))
+        return 1;
+    if (S_ISREG(in_st.st_mode))
+        method = S_ISREG(out_st.st_mode) ? COPY_FILE_RANGE : SENDFILE;
+    else if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))
+        method = SPLICE;
+    else
+        method = READ_WRITE;
+    char *buf = 0;
+    for (;;) {
+        ssize_t n;
+        switch (method) {
+        case COPY_FILE_RANGE:
+            n = copy_file_range(in, 0, out, 0, CHUNK, 0);
+            break;
+        case SENDFILE:
+            n = sendfile(out, in, 0, CHUNK);
+            break;
+        case SPLICE:
+            n = splice(in, 0, out, 0, CHUNK, SPLICE_F_MOVE);
+            break;
+        default:
+            if (!buf)
+                buf = arena_alloc(&line_arena, CHUNK);
+            n = read(in, buf, CHUNK);
+            if (n > 0 && write_all(out, buf, n))
+                return -1;
+        }
+        if (n > 0)
+            continue;
+        if (n == 0)
+            return 0;
+        if (errno == EINTR)
+            continue;
+        if (method == READ_WRITE ||
+            !(errno == EXDEV || errno == EINVAL || errno == EBADF ||
+              errno == EOPNOTSUPP || errno == ENOSYS))
+            return -1;
+        // not supported for these files: try the next method
+        if (method == COPY_FILE_RANGE ||
+            (method == SENDFILE && S_ISFIFO(out_st.st_mode)))
+            ++method;
+        else
+            method = READ_WRITE;
+    }
+}
+
+/* Decompressed input: <z:path feeds the first command with path through
+ * zlib (gzip files, or plain ones as they are), decompressed by a thread of
+ * the shell into a pipe, instead of a zcat stage of its own. The write ends
+ * of those pipes must not outlive the threads in forked copies of the
+ * shell (e.g. by fork_builtin), or their readers would never get an end of
+ * file: the atfork handlers close them in the children. A reader that can
+ * outlive its pipeline in the shell (in background, or with waitlast) gets
+ * an orphaned process instead, so that the shell can exit before it.
+ */
+static const size_t DECOMPRESS_BUF_SIZE = 128 * 1024;
+static const int DECOMPRESS_PIPE_SIZE = 1024 * 1024;
+
+typedef struct decompressor {
+        struct decompressor *next;
+        gzFile in;
+        int out;
+        char *pathname;
+} decompressor_t;
+
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t done; // signaled whenever one leaves running
+        decompressor_t *running;
+        int atfork_done;
+} decompressors = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                   .done = PTHREAD_COND_INITIALIZER};
+
+void decompressors_lock(void) { pthread_mutex_lock(&decompressors.lock); }
+
+void decompressors_unlock(void) { pthread_mutex_unlock(&decompressors.lock); }
+
+void decompressors_forget(void) {
+    /* In a forked child, where the threads do not exist */
+    for (decompressor_t *d = decompressors.running; d; d = d->next)
+        close(d->out);
+    decompressors.running = 0;
+    decompressors_unlock();
+}
+
+void decompress_into(gzFile in, int out, const char *const pathname) {
+    /* Writes the decompressed in to out, up to its end or an error */
+    char *const buf = my_malloc(DECOMPRESS_BUF_SIZE);
+    int n;
+    while ((n = gzread(in, buf, DECOMPRESS_BUF_SIZE)) > 0)
+        if (write_all(out, buf, n))
+            break;
+    // a truncated file ends with 0 too, but with Z_BUF_ERROR
+    int error;
+    const char *msg = gzerror(in, &error);
+    if (n < 0 || (error != Z_OK && error != Z_STREAM_END)) {
+        // zlib names the file after its fd: "<fd:3>: message"
+        const char *const colon = strstr(msg, ": ");
+        msg = error == Z_ERRNO ? strerror(errno) : colon ? colon + 2 : msg;
+        fprintf(stderr, "%s: %s\n", pathname, msg);
+    }
+    free(buf);
+    gzclose(in);
+}
+
+void *decompress(void *const arg) {
+    decompressor_t *const d = arg;
+    // like a zcat stage, stop when the reader is gone, but without the
+    // SIGPIPE that would kill the whole shell
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, 0);
+    decompress_into(d->in, d->out, d->pathname);
+    decompressors_lock();
+    decompressor_t **link = &decompressors.running;
+    while (*link != d)
+        link = &(*link)->next;
+    *link = d->next;
+    close(d->out);
+    pthread_cond_broadcast(&decompressors.done);
+    decompressors_unlock();
+    free(d->pathname);
+    free(d);
+    return 0;
+}
+
+void wait_decompressors(void) {
+    /* Before exiting: the threads would die with the process, truncating the
+     * input of their readers; those have been waited for already, so the
+     * threads are about to end (see fork_decompressor for the others) */
+    decompressors_lock();
+    while (decompressors.running)
+        pthread_cond_wait(&decompressors.done, &decompressors.lock);
+    decompressors_unlock();
+}
+
+int fork_decompressor(int fd, const int *const pipe_fds,
+                      const char *const pathname) {
+    /* Decompresses fd into pipe_fds[1] in a grandchild, left to init, so that
+     * neither the shell nor its exit wait for it; closes both and returns
+     * pipe_fds[0], or -1 */
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (pid == 0) {
+        const pid_t grandchild = fork();
+        if (grandchild < 0)
+            fatal_errno("fork failed on fork_decompressor");
+        if (grandchild)
+            _exit(0);
+        default_signals();
+        // only fd and the pipe, as 3 and 4: the pipes of the pipeline, or the
+        // connection of the server, must not be kept open by it
+        const int in = fcntl(fd, F_DUPFD, 5),
+                  out = fcntl(pipe_fds[1], F_DUPFD, 5);
+        if (in < 0 || out < 0 || dup2(in, 3) < 0 || dup2(out, 4) < 0 ||
+            close_range(5, ~0U, 0))
+            fatal_errno("decompressor");
+        const gzFile gz = gzdopen(3, "rb");
+        if (!gz)
+            fatal_errno(pathname);
+        gzbuffer(gz, DECOMPRESS_BUF_SIZE);
+        decompress_into(gz, 4, pathname);
+        _exit(0);
+    }
+    close(fd);
+    close(pipe_fds[1]);
+    int status;
+    while (pid > 0 && waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            fatal_errno("waitpid");
+    if (pid < 0)
+        perror("fork failed on fork_decompressor");
+    if (pid < 0 || status) {
+        close(pipe_fds[0]);
+        return -1;
+    }
+    return pipe_fds[0];
+}
+
+int start_decompressor(int fd, const char *const pathname, int orphaned) {
+    /* Starts decompressing the file fd (closed, in any case) into a new
+     * pipe, by a thread or, if orphaned, by a process of its own (see
+     * fork_decompressor); returns the read end of the pipe, or -1 */
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC)) {
+        perror("pipe2");
+        close(fd);
+        return -1;
+    }
+    // bigger writes, fewer wakeups of the reader (the size may be capped)
+    fcntl(pipe_fds[1], F_SETPIPE_SZ,
+          shell.pipe_size ? shell.pipe_size : DECOMPRESS_PIPE_SIZE);
+    if (orphaned)
+        return fork_decompressor(fd, pipe_fds, pathname);
+    decompressor_t *const d = my_malloc(sizeof(*d));
+    d->out = pipe_fds[1];
+    d->pathname = my_strdup(pathname);
+    if (!(d->in = gzdopen(fd, "rb"))) {
+        perror(pathname);
+        close(fd);
+        goto fail;
+    }
+    gzbuffer(d->in, DECOMPRESS_BUF_SIZE);
+    if (!decompressors.atfork_done) {
+        pthread_atfork(decompressors_lock, decompressors_unlock,
+                       decompressors_forget);
+        decompressors.atfork_done = 1;
+    }
+    decompressors_lock();
+    d->next = decompressors.running;
+    decompressors.running = d;
+    decompressors_unlock();
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    const int rv = pthread_create(&thread, &attr, decompress, d);
+    pthread_attr_destroy(&attr);
+    if (!rv)
+        return pipe_fds[0];
+    errno = rv;
+    perror("pthread_create");
+    decompressors_lock();
+    decompressors.running = d->next;
+    decompressors_unlock();
+    gzclose(d->in);
+fail:
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    free(d->pathname);
+    free(d);
+    return -1;
+}
+
+int here_fd(const command_t *const c) {
+    /* Returns a memfd holding the here-string or here-document of c, sealed
+     * and ready to be read from the start, or -1: the text never touches a
+     * filesystem */
+    const char *const text =
+        c->here_document ? c->here_document : c->here_string;
+    TRACE_BEGIN("here_fd", 0);
+    const int fd =
+        memfd_create("microbash-here", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    if (write_all(fd, text, strlen(text)) ||
+        (!c->here_document && write_all(fd, "\n", 1)) ||
+        fcntl(fd, F_ADD_SEALS,
+              F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) ||
+        lseek(fd, 0, SEEK_SET)) {
+        perror("here-document");
+        close(fd);
+        return -1;
+    }
+    TRACE_END("here_fd", fd);
+    return fd;
+}
+
+int open_output(const char *const pathname, int append) {
+    // 0664 = read/write for owner, read/write for group, read for others
+    TRACE_BEGIN("open", 0);
+    const int fd = open(pathname,
+                        O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC) |
+                            O_CLOEXEC,
+                        0664);
+    TRACE_END("open", fd);
+    if (fd < 0)
+        perror(pathname);
+    return fd;
+}
+
+void preallocate(int fd) {
+    /* With set prealloc=SIZE, reserves SIZE bytes past the end of the output
+     * file fd, without changing its size, so that long-running writers get
+     * contiguous extents and fewer metadata updates; nothing is done on the
+     * filesystems without fallocate */
+    struct stat st;
+    if (!shell.prealloc || fstat(fd, &st) || !S_ISREG(st.st_mode))
+        return;
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, st.st_size, shell.prealloc) &&
+        errno != EOPNOTSUPP && errno != ENOSYS)
+        perror("fallocate");
+}
+
+int setup_fds(const pipeline_t *const l, int background, int *const fds,
+              int *const errs) {
+    /* Builds, in one pass and before spawning anything, the whole fd layout
+     * of the line: command a reads from fds[2 * a], writes to
+     * fds[2 * a + 1] and reports errors to errs[a] (NO_REDIR to use the
+     * ones of the shell, ERR_TO_OUT for 2>&1). Every fd is
+     * created with O_CLOEXEC in the same syscall, so the spawn loop needs
+     * no fcntl. Returns -1, with nothing open, in case of errors.
+     */
+    const int n_fds = 2 * l->n_commands;
+    for (int f = 0; f < n_fds; ++f)
+        fds[f] = NO_REDIR;
+    for (int a = 0; a < l->n_commands; ++a)
+        errs[a] = l->commands[a]->err_to_out ? ERR_TO_OUT : NO_REDIR;
+    // like in POSIX shells without job control, background jobs cannot read
+    // the input of the shell
+    if (background && !has_input(l->commands[0]) &&
+        (fds[0] = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+        perror("/dev/null");
+        return -1;
+    }
     for (int a = 0; a < l->n_commands; ++a) {
-        int curr_stdin = next_stdin, curr_stdout = NO_REDIR;
         const command_t *const c = l->commands[a];
         if (c->in_pathname) {
             assert(a == 0);
             /* Open c->in_pathname and assign the file-descriptor to
              * curr_stdin (handling error cases) */
             /*** TO BE DONE START ***/
-            curr_stdin = open(c->in_pathname, O_RDONLY);
-            if (curr_stdin < 0) {
+            TRACE_BEGIN("open", 0);
+            fds[2 * a] = open(c->in_pathname, O_RDONLY | O_CLOEXEC);
+            TRACE_END("open", fds[2 * a]);
+            if (fds[2 * a] < 0) {
                 perror(c->in_pathname);
-                return;
+                goto fail;
             }
             /*** TO BE DONE END ***/
+            if (c->in_decompress &&
+                (fds[2 * a] =
+                     start_decompressor(fds[2 * a], c->in_pathname,
+                                        background || shell.wait_last)) < 0)
+                goto fail;
+        } else if (has_input(c)) {
+            assert(a == 0);
+            if ((fds[2 * a] = here_fd(c)) < 0)
+                goto fail;
         }
         if (c->out_pathname) {
             assert(a == (l->n_commands - 1));
             /* Open c->out_pathname and assign the file-descriptor to
              * curr_stdout (handling error cases) */
             /*** TO BE DONE START ***/
-            // 0664 = read/write for owner, read/write for group, read for
-            // others
-            curr_stdout =
-                open(c->out_pathname, O_WRONLY | O_CREAT | O_TRUNC, 0664);
-            if (curr_stdout < 0) {
-                perror(c->out_pathname);
-                return;
+            fds[2 * a + 1] = open_output(c->out_pathname, c->out_append);
+            if (fds[2 * a + 1] < 0) {
+                goto fail;
             }
             /*** TO BE DONE END ***/
+            preallocate(fds[2 * a + 1]);
         } else if (a != (l->n_commands -
                          1)) { /* unless we're processing the last command,
                                   we need to connect the current command and
                                   the next one with a pipe */
-            int fds[2];
+            int pipe_fds[2];
             /* Create a pipe in fds, and set FD_CLOEXEC in both
              * file-descriptor flags */
             /*** TO BE DONE START ***/
-            if (pipe(fds) == -1) {
-                fatal_errno("pipe");
+            // unlike pipe+fcntl, there is no window in which a concurrently
+            // spawned child could inherit the pipe
+            TRACE_BEGIN("pipe2", 0);
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+                fatal_errno("pipe2");
             }
+            TRACE_END("pipe2", pipe_fds[0]);
+            /*** TO BE DONE END ***/
+            // bigger pipes mean fewer context switches between the stages
+            if (shell.pipe_size &&
+                fcntl(pipe_fds[1], F_SETPIPE_SZ, shell.pipe_size) == -1)
+                perror("fcntl F_SETPIPE_SZ");
+            fds[2 * a + 1] = pipe_fds[1];
+            fds[2 * a + 2] = pipe_fds[0];
+        }
+        if (c->err_pathname) {
+            if ((errs[a] = open_output(c->err_pathname, c->err_append)) < 0)
+                goto fail;
+            preallocate(errs[a]);
+        }
+    }
+    return 0;
+fail:
+    close_fds(fds, n_fds);
+    close_fds(errs, l->n_commands);
+    return -1;
+}
+
+char *describe_pipelines(const line_t *const l, int first, int last) {
+    /* Returns the text of the pipelines first..last of l (allocated via
+     * malloc), as shown by jobs: they are run in background */
+    size_t len = 2;
+    for (int i = first; i <= last; ++i) {
+        const pipeline_t *const pl = l->pipelines[i];
+        len += 3 + (pl->timed ? strlen(TIME) + 1 : 0);
+        for (int a = 0; a < pl->n_commands; ++a) {
+            const command_t *const c = pl->commands[a];
+            for (int i = 0; i < c->n_args; ++i)
+                len += strlen(c->args[i]) + 1;
+            if (c->in_pathname)
+                len += strlen(c->in_pathname) + 4;
+            if (c->here_string)
+                len += strlen(c->here_string) + 4;
+            if (c->here_document)
+                len += 6;
+            if (c->cpus)
+                len += strlen(c->cpus) + 6;
+            len += (c->mem ? 26 : 0) + (c->has_nice ? 10 : 0);
+            if (c->out_pathname)
+                len += strlen(c->out_pathname) + 3;
+            if (c->err_pathname)
+                len += strlen(c->err_pathname) + 4;
+            len += 2 + 5 * c->err_to_out;
+        }
+    }
+    static const char *const OPS[] = {"; ", "&& ", "|| "};
+    char *const text = my_malloc(len), *p = text;
+    for (int i = first; i <= last; ++i) {
+        const pipeline_t *const pl = l->pipelines[i];
+        if (i > first)
+            p = stpcpy(p, l->pipelines[i - 1]->background ? "& "
+                                                           : OPS[pl->op]);
+        if (pl->timed)
+            p += sprintf(p, "%s ", TIME);
+        for (int a = 0; a < pl->n_commands; ++a) {
+            const command_t *const c = pl->commands[a];
+            if (a)
+                p = stpcpy(p, "| ");
+            if (c->cpus)
+                p += sprintf(p, "@cpu=%s ", c->cpus);
+            if (c->mem)
+                p += sprintf(p, "@mem=%llu ", c->mem);
+            if (c->has_nice)
+                p += sprintf(p, "@nice=%d ", c->nice);
+            for (int i = 0; i < c->n_args; ++i)
+                p += sprintf(p, "%s ", c->args[i]);
+            if (c->in_pathname)
+                p += sprintf(p, "<%s%s ", c->in_decompress ? "z:" : "",
+                             c->in_pathname);
+            if (c->here_string)
+                p += sprintf(p, "<<<%s ", c->here_string);
+            if (c->here_document)
+                p = stpcpy(p, "<<... ");
+            if (c->out_pathname)
+                p += sprintf(p, "%s%s ", c->out_append ? ">>" : ">",
+                             c->out_pathname);
+            if (c->err_pathname)
+                p += sprintf(p, "%s%s ", c->err_append ? "2>>" : "2>",
+                             c->err_pathname);
+            if (c->err_to_out)
+                p = stpcpy(p, "2>&1 ");
+        }
+    }
+    strcpy(p, "&");
+    return text;
+}
+
+int open_pidfd(pid_t pid) {
+    const int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0)
+        fatal_errno("pidfd_open");
+    // O_CLOEXEC is implied: pidfds are never inherited by the children
+    return pidfd;
+}
+
+job_t *new_job(int n_procs) {
+    job_t *const j = my_malloc(sizeof(*j));
+    memset(j, 0, sizeof(*j));
+    j->line = ++shell.n_lines;
+    j->n_procs = n_procs;
+    j->procs = my_malloc(n_procs * sizeof(proc_t));
+    memset(j->procs, 0, n_procs * sizeof(proc_t));
+    for (int a = 0; a < n_procs; ++a)
+        j->procs[a].pidfd = -1;
+    clock_gettime(CLOCK_MONOTONIC, &j->start);
+    return j;
+}
+
+job_t *start_pipeline(const pipeline_t *const pipeline, int background) {
+    /* Spawns the commands of pipeline, and returns the job they belong to,
+     * which still has to be waited for, or 0 if nothing could be started */
+    const pipeline_t *const expanded = expand_pipeline(pipeline);
+    // $VAR and $(...) can make a cd or another builtin that must be alone
+    if (expanded != pipeline && (check_cd(expanded) != CHECK_OK ||
+                                 check_builtins(expanded) != CHECK_OK))
+        return 0;
+    const pipeline_t *const l = optimize_pipeline(expanded);
+    int *const fds = arena_alloc(&line_arena, 2 * l->n_commands * sizeof(int));
+    int *const errs = arena_alloc(&line_arena, l->n_commands * sizeof(int));
+    job_t *const j = new_job(l->n_commands);
+    j->timed = l->timed;
+    TRACE_BEGIN("setup_fds", l->n_commands);
+    const int failed = setup_fds(l, background, fds, errs);
+    TRACE_END("setup_fds", failed);
+    if (failed) {
+        free_job(j);
+        return 0;
+    }
+    for (int a = 0; a < l->n_commands; ++a) {
+        const int curr_stdin = fds[2 * a], curr_stdout = fds[2 * a + 1];
+        const command_t *const c = l->commands[a];
+        const builtin_t *const b = c->n_args ? find_builtin(c->args[0]) : 0;
+        proc_t *const p = &j->procs[a];
+        // a command can be left with no words by $(...)
+        p->name = my_strdup(c->n_args          ? c->args[0]
+                            : c->n_assignments ? c->assignments[0]
+                                               : "");
+        clock_gettime(CLOCK_MONOTONIC, &p->start);
+        if (!c->n_args) {
+            // like in POSIX shells, a pipeline or a background job is run by
+            // subshells, whose variables are lost
+            if (pipeline->n_commands == 1 && !background)
+                assign_variables(c);
+        } else if (l->n_commands == 1 && has_input(c) && is_identity(c) &&
+            !background) {
+            fflush(stdout);
+            const int rv = copy_fd(curr_stdin, curr_stdout == NO_REDIR
+                                                   ? STDOUT_FILENO
+                                                   : curr_stdout);
+            if (rv > 0)
+                fprintf(stderr, "%s: input file is output file\n", CAT);
+            else if (rv)
+                perror(CAT);
+            if (rv)
+                p->status = W_EXITCODE(1, 0);
+        } else if (!b) {
+            if (!(p->pid = run_child(c, curr_stdin, curr_stdout, errs[a])))
+                p->status = W_EXITCODE(127, 0); // like command not found
+        } else if (pipeline->n_commands == 1 && !background &&
+                   !has_limits(c)) {
+            p->status =
+                W_EXITCODE(run_builtin(b, c, curr_stdin, curr_stdout, errs[a]),
+                           0);
+        } else // so that it can neither block nor change the shell
+            p->pid = fork_builtin(b, c, fds + 2 * a, errs + a,
+                                  l->n_commands - a);
+        if (p->pid) {
+            p->pidfd = open_pidfd(p->pid);
+            ++j->n_running;
+        }
+        // what is left open are the fds of the next commands only
+        close_fds(fds + 2 * a, 2);
+        close_fds(errs + a, 1);
+    }
+    return j;
+}
+
+job_t *start_subshell(const line_t *const l, int first, int last);
 
-            // If the FD_CLOEXEC bit is set, the file descriptor will
-            // automatically be closed during a successful execve
-            if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1) {
-                fatal_errno("fcntl read-end");
+job_t *start_background(const line_t *const l, int first, int last) {
+    /* Starts the and-or list first..last of l in background, returning its
+     * job, not added to the table yet, or 0 if nothing could be started; a
+     * single pipeline needs no subshell */
+    job_t *const j = first == last ? start_pipeline(l->pipelines[first], 1)
+                                   : start_subshell(l, first, last);
+    if (!j)
+        return 0;
+    j->text = describe_pipelines(l, first, last);
+    if (j->n_running)
+        shell.last_background = j->procs[j->n_procs - 1].pid;
+    return j;
+}
+
+int execute_pipeline(const line_t *const l, int i) {
+    /* Runs the pipeline i of l in foreground, returning its exit status;
+     * with waitlast, the commands still running when the last one exits
+     * are left to the job table */
+    TRACE_BEGIN("start_pipeline", i);
+    job_t *const j = start_pipeline(l->pipelines[i], 0);
+    TRACE_END("start_pipeline", j ? j->n_running : -1);
+    if (!j)
+        return shell.last_status = 1;
+    if (shell.wait_last && wait_for_last(j)) {
+        j->text = describe_pipelines(l, i, i);
+        add_job(j);
+        printf("[%d] Running\t%s\n", j->id, j->text);
+        return shell.last_status = job_status(j);
+    }
+    wait_for_children(j);
+    finish_job(j);
+    shell.last_status = job_status(j);
+    free_job(j);
+    return shell.last_status;
+}
+
+int execute_pipelines(const line_t *const l, int first, int last,
+                      int subshell) {
+    /* Runs the pipelines first..last of l, one and-or list at a time: those
+     * followed by '&' in background, unless it is the last one and this is
+     * a subshell, which is in background already. Returns the status of the
+     * last pipeline run in foreground.
+     */
+    for (int begin = first; begin <= last && !shell.exit_requested;) {
+        int end = begin;
+        while (end < last && l->pipelines[end + 1]->op != OP_SEQ)
+            ++end;
+        if (l->pipelines[end]->background && !(subshell && end == last)) {
+            job_t *const j = start_background(l, begin, end);
+            if (j) {
+                add_job(j);
+                if (j->n_running)
+                    printf("[%d] %d\n", j->id, j->procs[j->n_procs - 1].pid);
+                else // nothing could be spawned
+                    finish_job(j);
             }
-            if (fcntl(fds[1], F_SETFD, FD_CLOEXEC) == -1) {
-                fatal_errno("fcntl write-end");
+            shell.last_status = 0;
+        } else {
+            for (int p = begin; p <= end && !shell.exit_requested; ++p) {
+                const pipeline_t *const pl = l->pipelines[p];
+                // in "a && b || c", c runs when either a or b fails
+                if ((pl->op == OP_AND && shell.last_status) ||
+                    (pl->op == OP_OR && !shell.last_status))
+                    continue;
+                execute_pipeline(l, p);
             }
-            /*** TO BE DONE END ***/
-            curr_stdout = fds[1];
-            next_stdin = fds[0];
         }
-        run_child(c, curr_stdin, curr_stdout);
-        close_if_needed(curr_stdin);
-        close_if_needed(curr_stdout);
+        begin = end + 1;
+    }
+    return shell.last_status;
+}
+
+job_t *start_subshell(const line_t *const l, int first, int last) {
+    /* Runs the pipelines first..last of l in a forked copy of the shell,
+     * like POSIX shells do with an and-or list followed by '&' */
+    job_t *const j = new_job(1);
+    proc_t *const p = &j->procs[0];
+    p->name = my_strdup("microbash");
+    clock_gettime(CLOCK_MONOTONIC, &p->start);
+    fflush(stdout);
+    if ((p->pid = fork()) < 0)
+        fatal_errno("fork failed on start_subshell");
+    if (p->pid == 0) {
+        forget_jobs();
+        default_signals();
+        const int null = open("/dev/null", O_RDONLY);
+        if (null < 0)
+            fatal_errno("/dev/null");
+        redirect(null, STDIN_FILENO);
+        execute_pipelines(l, first, last, 1);
+        fflush(stdout);
+        _exit(shell.last_status);
     }
-    wait_for_children();
+    p->pidfd = open_pidfd(p->pid);
+    j->n_running = 1;
+    return j;
+}
+
+void execute_line(const line_t *const l) {
+    execute_pipelines(l, 0, l->n_pipelines - 1, 0);
 }
 
 void execute(char *const line) {
-    line_t *const l = parse_line(line);
+    TRACE_BEGIN("execute", shell.n_lines);
+    reap_children(0); // report the background jobs done in the meantime
+    const uint64_t hash = hash_string(line);
+    line_entry_t *e = line_cache.capacity ? line_cache_find(line, hash) : 0;
+    if (!e) {
+        // parse_line tokenizes line in place: keep what the cache needs
+        const char *const text =
+            line_cache.capacity ? arena_strdup(&line_arena, line) : 0;
+        TRACE_BEGIN("parse_line", 0);
+        line_t *const l = parse_line(line);
+        TRACE_END("parse_line", l != 0);
+        if (l && check_line(l) == CHECK_OK) {
+            // the text of here-documents is not part of the line
+            if (text && !l->has_here_documents)
+                e = line_cache_enter(text, hash, l);
+            else
+                execute_line(l);
+        }
+    }
+    if (e) {
+        ++e->users;
 #ifdef DEBUG
-    print_line(l);
+        print_line(e->line);
+#endif
+        execute_line(e->line);
+        --e->users;
+    }
+    arena_reset(&line_arena);
+    TRACE_END("execute", shell.last_status);
+    TRACE_FLUSH();
+}
+
+char *read_input_line(const char *const prompt) {
+    /* Returns the next line of the input (allocated via malloc, without the
+     * newline), or 0 at its end; used for the text of here-documents */
+#ifndef NO_READLINE
+    if (!shell.input)
+        return readline(prompt);
 #endif
-    if (l) {
-        if (check_redirections(l) == CHECK_OK && check_cd(l) == CHECK_OK)
-            execute_line(l);
-        free_line(l);
+    FILE *const in = shell.input ? shell.input : stdin;
+    if (in == stdin && isatty(STDIN_FILENO)) {
+        printf("%s", prompt);
+        fflush(stdout);
+    }
+    char *line = 0;
+    size_t size = 0;
+    const ssize_t len = getline(&line, &size, in);
+    if (len < 0) {
+        free(line);
+        return 0;
+    }
+    if (len && line[len - 1] == '\n')
+        line[len - 1] = 0;
+    return line;
+}
+
+void run_script(FILE *const in) {
+    /* Batch mode: execute the lines of in back-to-back, with no prompt and no
+     * history; getline has no line-length limit and reuses its buffer
+     */
+    char *line = 0;
+    size_t size = 0;
+    ssize_t len;
+    FILE *const input = shell.input;
+    shell.input = in;
+    while ((len = getline(&line, &size, in)) >= 0) {
+        if (len && line[len - 1] == '\n')
+            line[--len] = 0;
+        execute(line);
+        if (shell.exit_requested)
+            break;
+    }
+    if (ferror(in))
+        perror("getline");
+    shell.input = input;
+    free(line);
+}
+
+/* The prompt is rendered from PS1, whose \w, \W, \u, \h, \$ and \\ are
+ * replaced like in bash, only when PS1, HOME or the current directory
+ * change: otherwise, showing it costs a couple of strcmp.
+ */
+static const char *const DEFAULT_PS1 = "\\w $ ";
+
+static struct {
+        char *text, *ps1, *home;
+        size_t size, len;
+        unsigned long cwd_changes;
+        char *user, *host; // looked up once
+} prompt_cache;
+
+void prompt_append(const char *const s, size_t n) {
+    if (prompt_cache.len + n + 1 > prompt_cache.size) {
+        prompt_cache.size = 2 * (prompt_cache.len + n + 1);
+        prompt_cache.text = my_realloc(prompt_cache.text, prompt_cache.size);
+    }
+    memcpy(prompt_cache.text + prompt_cache.len, s, n);
+    prompt_cache.text[prompt_cache.len += n] = 0;
+}
+
+void prompt_append_cwd(const char *const home, int basename_only) {
+    const size_t home_len = home ? strlen(home) : 0;
+    if (home_len > 1 && strncmp(cwd.path, home, home_len) == 0 &&
+        (!cwd.path[home_len] || cwd.path[home_len] == '/')) {
+        if (basename_only && cwd.path[home_len]) {
+            const char *const base = strrchr(cwd.path, '/') + 1;
+            prompt_append(base, strlen(base));
+            return;
+        }
+        prompt_append("~", 1);
+        if (!basename_only)
+            prompt_append(cwd.path + home_len, strlen(cwd.path + home_len));
+        return;
+    }
+    const char *const base = strrchr(cwd.path, '/');
+    const char *const s =
+        basename_only && base && base[1] ? base + 1 : cwd.path;
+    prompt_append(s, strlen(s));
+}
+
+int same_string(const char *const a, const char *const b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+const char *prompt(void) {
+    const char *ps1 = var_get("PS1");
+    if (!ps1)
+        ps1 = DEFAULT_PS1;
+    const char *const home = var_get("HOME");
+    if (prompt_cache.text && prompt_cache.cwd_changes == cwd.changes &&
+        same_string(prompt_cache.ps1, ps1) &&
+        same_string(prompt_cache.home, home))
+        return prompt_cache.text;
+    free(prompt_cache.ps1);
+    free(prompt_cache.home);
+    prompt_cache.ps1 = my_strdup(ps1);
+    prompt_cache.home = home ? my_strdup(home) : 0;
+    prompt_cache.cwd_changes = cwd.changes;
+    prompt_cache.len = 0;
+    prompt_append("", 0);
+    for (const char *p = ps1; *p; ++p) {
+        if (*p != '\\' || !p[1]) {
+            prompt_append(p, 1);
+            continue;
+        }
+        switch (*++p) {
+        case 'w':
+        case 'W':
+            prompt_append_cwd(home, *p == 'W');
+            break;
+        case 'u':
+            if (!prompt_cache.user) {
+                const struct passwd *const pw = getpwuid(geteuid());
+                prompt_cache.user = my_strdup(pw ? pw->pw_name : "?");
+            }
+            prompt_append(prompt_cache.user, strlen(prompt_cache.user));
+            break;
+        case 'h':
+            if (!prompt_cache.host) {
+                char host[256] = "?";
+                gethostname(host, sizeof(host) - 1);
+                host[strcspn(host, ".")] = 0;
+                prompt_cache.host = my_strdup(host);
+            }
+            prompt_append(prompt_cache.host, strlen(prompt_cache.host));
+            break;
+        case '$':
+            prompt_append(geteuid() ? "$" : "#", 1);
+            break;
+        case '\\':
+            prompt_append("\\", 1);
+            break;
+        default:
+            prompt_append(p - 1, 2);
+        }
     }
+    return prompt_cache.text;
 }
 
-int main(void) {
-    const char *const prompt_suffix = " $ ";
-    const size_t prompt_suffix_len = strlen(prompt_suffix);
+void run_interactive(void) {
+#ifdef NO_READLINE
+    shell.input = stdin;
+#endif
+    load_history();
     for (;;) {
-        char *pwd;
-        /* Make pwd point to a string containing the current working
-         * directory. The memory area must be allocated (directly or
-         * indirectly) via malloc.
+        const char *pwd;
+        /* Make pwd point to the prompt, which contains the current working
+         * directory: it is kept by the shell (see prompt), not asked to the
+         * kernel each time.
          */
         /*** TO BE DONE START ***/
-        pwd = getcwd(NULL, 0);
+        pwd = prompt();
         /*** TO BE DONE END ***/
-        pwd = my_realloc(pwd, strlen(pwd) + prompt_suffix_len + 1);
-        strcat(pwd, prompt_suffix);
 #ifdef NO_READLINE
-        const int max_line_size = 512;
-        char *line = my_malloc(max_line_size);
+        char *line = 0;
+        size_t size = 0;
+        ssize_t len;
         printf("%s", pwd);
-        if (!fgets(line, max_line_size, stdin)) {
+        fflush(stdout);
+        if ((len = getline(&line, &size, stdin)) < 0) {
             free(line);
             line = 0;
             putchar('\n');
-        } else {
-            size_t l = strlen(line);
-            if (l && line[--l] == '\n')
-                line[l] = 0;
-        }
+        } else if (len && line[len - 1] == '\n')
+            line[--len] = 0;
 #else
         char *const line = readline(pwd);
 #endif
-        free(pwd);
         if (!line)
             break;
+        remember_line(line);
         execute(line);
         free(line);
+        if (shell.exit_requested)
+            break;
+    }
+}
+
+/* Server mode: microbash --server SOCKET listens on a UNIX socket and runs
+ * the scripts its clients send, one connection at a time, so that a task
+ * costs a round-trip instead of the start of a shell. A request is a frame:
+ * the length of the text as a uint32_t, then the text, one or more lines
+ * run like a script. The length may come with up to SERVER_FDS fds
+ * (SCM_RIGHTS): the stdin, stdout and stderr of the script, in this order;
+ * the missing ones are those of the server. The reply is the exit-status,
+ * as an int32_t. Integers are in host byte order, as the socket is local.
+ * The shell state (variables, directory, jobs) carries over from script to
+ * script; exit only ends the connection.
+ */
+#define SERVER_FDS 3
+static const uint32_t SERVER_MAX_FRAME = 64 * 1024 * 1024;
+
+int receive_frame(int conn, char **const text, uint32_t *const len,
+                  int *const fds) {
+    /* Receives a frame from conn: its text into *text (allocated via malloc)
+     * and its fds into fds (NO_REDIR for the missing ones). Returns -1 at the
+     * end of the connection, or if the frame is malformed. */
+    union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(SERVER_FDS * sizeof(int))];
+    } control;
+    struct iovec iov = {len, sizeof(*len)};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buf,
+                         .msg_controllen = sizeof(control.buf)};
+    for (int i = 0; i < SERVER_FDS; ++i)
+        fds[i] = NO_REDIR;
+    ssize_t n;
+    while ((n = recvmsg(conn, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC)) < 0 &&
+           errno == EINTR)
+        ;
+    // fds that do not fit into control are closed by the kernel
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); n > 0 && c;
+         c = CMSG_NXTHDR(&msg, c))
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+            memcpy(fds, CMSG_DATA(c), c->cmsg_len - CMSG_LEN(0));
+    if (n == sizeof(*len) && *len <= SERVER_MAX_FRAME) {
+        *text = my_malloc(*len + 1);
+        if (!*len) // an empty script: recv would wait for the end
+            return 0;
+        while ((n = recv(conn, *text, *len, MSG_WAITALL)) < 0 && errno == EINTR)
+            ;
+        if (n == *len)
+            return 0;
+        free(*text);
+    }
+    if (n < 0)
+        perror("server: recv");
+    else if (n)
+        fprintf(stderr, "server: malformed frame\n");
+    close_fds(fds, SERVER_FDS);
+    return -1;
+}
+
+void serve(int conn, const int *const saved) {
+    /* Runs the scripts sent over conn, with their fds moved over 0, 1 and 2,
+     * and replies with their exit-statuses; saved are dups of the fds of
+     * the server, to put back */
+    char *text;
+    uint32_t len;
+    int fds[SERVER_FDS];
+    while (!receive_frame(conn, &text, &len, fds)) {
+        fflush(stdout);
+        fflush(stderr);
+        for (int i = 0; i < SERVER_FDS; ++i)
+            redirect(fds[i], i);
+        FILE *const script = len ? fmemopen(text, len, "r") : 0;
+        if (script) {
+            run_script(script);
+            fclose(script);
+        } else {
+            if (len)
+                perror("fmemopen");
+            shell.last_status = len ? 1 : 0; // 0, like an empty script
+        }
+        free(text);
+        fflush(stdout);
+        fflush(stderr);
+        for (int i = 0; i < SERVER_FDS; ++i)
+            if (fds[i] != NO_REDIR && dup2(saved[i], i) < 0)
+                fatal_errno("dup2 failed");
+        const int32_t status =
+            shell.exit_requested ? shell.exit_status : shell.last_status;
+        const int done = shell.exit_requested;
+        shell.exit_requested = 0;
+        if (send(conn, &status, sizeof(status), MSG_NOSIGNAL) < 0) {
+            perror("server: send");
+            break;
+        }
+        if (done)
+            break;
+    }
+}
+
+void run_server(const char *const path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket pathname too long\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+    struct stat st;
+    // replace the socket of a previous server, but nothing else
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        fatal_errno("socket");
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, 16))
+        fatal_errno(path);
+    // a client can close the read end of the stdout it sent; the children
+    // get SIGPIPE back, see default_signals
+    signal(SIGPIPE, SIG_IGN);
+    int saved[SERVER_FDS];
+    for (int i = 0; i < SERVER_FDS; ++i)
+        if ((saved[i] = fcntl(i, F_DUPFD_CLOEXEC, SERVER_FDS)) < 0)
+            fatal_errno("fcntl");
+    for (;;) {
+        const int conn = accept4(sock, 0, 0, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                fatal_errno("accept4");
+            continue;
+        }
+        serve(conn, saved);
+        close(conn);
+        reap_children(0);
+    }
+}
+
+void usage(const char *const argv0) {
+    fprintf(stderr, "Usage: %s [-f script | --server socket]\n", argv0);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    // keep the messages of wait_for_children in order with the output of the
+    // children, even when stdout is not a terminal
+    setvbuf(stdout, 0, _IOLBF, 0);
+    TRACE_OPEN();
+    shell.pid = getpid();
+    import_environ();
+    init_cwd();
+    if (argc == 3 && strcmp(argv[1], "-f") == 0) {
+        FILE *const script = fopen(argv[2], "re");
+        if (!script)
+            fatal_errno(argv[2]);
+        run_script(script);
+        fclose(script);
+    } else if (argc == 3 && strcmp(argv[1], "--server") == 0) {
+        run_server(argv[2]);
+    } else if (argc != 1) {
+        usage(argv[0]);
+    } else if (!isatty(STDIN_FILENO)) {
+        run_script(stdin);
+    } else {
+        run_interactive();
     }
+    wait_decompressors();
+    return shell.exit_requested ? shell.exit_status : shell.last_status;
 }